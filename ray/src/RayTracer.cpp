@@ -3,14 +3,17 @@
 #pragma warning (disable: 4786)
 
 #include "RayTracer.h"
+#include "scene/accelCache.h"
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/rayPacket.h"
 
 #include "parser/Tokenizer.h"
 #include "parser/Parser.h"
 
 #include "ui/TraceUI.h"
+#include <chrono>
 #include <cmath>
 #include <algorithm>
 #include <glm/glm.hpp>
@@ -28,6 +31,18 @@ extern TraceUI* traceUI;
 // in TraceGLWindow, for example.
 bool debugMode = false;
 
+namespace {
+// How far apart four colours look: the largest difference in any
+// channel, once clamped to what can be displayed.
+double spread(const glm::dvec3 c[4])
+{
+	glm::dvec3 lo = glm::min(glm::min(c[0], c[1]), glm::min(c[2], c[3]));
+	glm::dvec3 hi = glm::max(glm::max(c[0], c[1]), glm::max(c[2], c[3]));
+	glm::dvec3 d = glm::clamp(hi, 0.0, 1.0) - glm::clamp(lo, 0.0, 1.0);
+	return std::max(d[0], std::max(d[1], d[2]));
+}
+}
+
 // Trace a top-level ray through pixel(i,j), i.e. normalized window coordinates (x,y),
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
@@ -43,8 +58,12 @@ glm::dvec3 RayTracer::trace(double x, double y)
 	scene->getCamera().rayThrough(x,y,r);
 	double dummy;
 	glm::dvec3 ret = traceRay(r, glm::dvec3(1.0,1.0,1.0), traceUI->getDepth(), dummy);
-	ret = glm::clamp(ret, 0.0, 1.0);
-	return ret;
+	return sample(ret);
+}
+
+glm::dvec3 RayTracer::sample(const glm::dvec3& color) const
+{
+	return clampSamples ? glm::clamp(color, 0.0, 1.0) : color;
 }
 
 glm::dvec3 RayTracer::tracePixel(int i, int j)
@@ -56,12 +75,8 @@ glm::dvec3 RayTracer::tracePixel(int i, int j)
 	double x = double(i)/double(buffer_width);
 	double y = double(j)/double(buffer_height);
 
-	unsigned char *pixel = buffer.data() + ( i + j * buffer_width ) * 3;
 	col = trace(x, y);
-
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
+	setPixel(i, j, col);
 	return col;
 }
 
@@ -72,25 +87,37 @@ glm::dvec3 RayTracer::tracePixel(int i, int j)
 glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, double& t )
 {
 	isect i;
+	bool hit = scene->intersect(r, i);
+	return shadeRay(r, i, hit, thresh, depth, t);
+}
+
+// The color seen along r, given what scene->intersect() found for it.
+glm::dvec3 RayTracer::shadeRay(ray& r, const isect& i, bool hit,
+                               const glm::dvec3& thresh, int depth, double& t)
+{
 	glm::dvec3 colorC;
 #if VERBOSE
 	std::cerr << "== current depth: " << depth << std::endl;
 #endif
 
-	if(scene->intersect(r, i)) {
-		// YOUR CODE HERE
-
-		// An intersection occurred!  We've got work to do.  For now,
-		// this code gets the material for the surface that was intersected,
-		// and asks that material to provide a color for the ray.
-
-		// This is a great place to insert code for recursive ray tracing.
-		// Instead of just returning the result of shade(), add some
-		// more steps: add in the contributions from reflected and refracted
-		// rays.
-
+	if(hit) {
+		// An intersection occurred!  The material gives the light
+		// leaving the surface directly, and the reflected and refracted
+		// rays bring in the rest, weighted by kr and kt.
 		const Material& m = i.getMaterial();
 		colorC = m.shade(scene.get(), r, i);
+		if (depth > 0) {
+			Bounce out[2];
+			int n = bounces(r, i, m, out);
+			for (int k = 0; k < n; k++) {
+				ray next(out[k].origin, out[k].direction,
+				         thresh * out[k].weight, out[k].type);
+				double length;
+				colorC += out[k].weight *
+				          traceRay(next, thresh * out[k].weight,
+				                   depth - 1, length);
+			}
+		}
 	} else {
 		// No intersection.  This ray travels to infinity, so we color
 		// it according to the background color, which in this (simple) case
@@ -109,18 +136,67 @@ glm::dvec3 RayTracer::traceRay(ray& r, const glm::dvec3& thresh, int depth, doub
 	return colorC;
 }
 
+// The reflected and refracted rays leaving hit i of r on material m, if
+// it has kr or kt.  Normals point out of closed objects, so a ray meeting
+// the surface from behind is leaving the object.  A refracted ray that
+// cannot leave (total internal reflection) is reflected instead.
+int RayTracer::bounces(const ray& r, const isect& i, const Material& m,
+                       Bounce out[2]) const
+{
+	int n = 0;
+	glm::dvec3 d = r.getDirection();
+	glm::dvec3 N = i.getN();
+	glm::dvec3 p = r.at(i);
+	glm::dvec3 reflected = glm::normalize(d - 2.0 * glm::dot(d, N) * N);
+	if (m.Refl())
+		out[n++] = Bounce{p, reflected, m.kr(i), ray::REFLECTION};
+	if (m.Trans()) {
+		double cosI = -glm::dot(d, N);
+		double eta = 1.0 / m.index(i);
+		if (cosI < 0.0) {
+			cosI = -cosI;
+			N = -N;
+			eta = 1.0 / eta;
+		}
+		double k = 1.0 - eta * eta * (1.0 - cosI * cosI);
+		if (k < 0.0)
+			out[n++] = Bounce{p, reflected, m.kt(i), ray::REFLECTION};
+		else
+			out[n++] = Bounce{p,
+			                  glm::normalize(eta * d +
+			                                 (eta * cosI - std::sqrt(k)) *
+			                                         N),
+			                  m.kt(i), ray::REFRACTION};
+	}
+	return n;
+}
+
 RayTracer::RayTracer()
-	: scene(nullptr), buffer(0), thresh(0), buffer_width(256), buffer_height(256), m_bBufferReady(false)
+	: scene(nullptr), thresh(0), buffer_width(256), buffer_height(256), m_bBufferReady(false)
 {
+	stopTrace = false;
+	activeWorkers = 0;
+	passesRunning = false;
 }
 
 RayTracer::~RayTracer()
 {
+	stopTrace = true;
+	waitRender();
+}
+
+// Row j of the float buffer, as the mean of each pixel's samples.
+void RayTracer::getFloatRow(int j, float* rgb) const
+{
+	buffer.getRow(j, rgb);
 }
 
+// The image so far, in 8 bits per channel.  Each call converts the whole
+// float buffer again, so that a window refreshing during a render shows
+// the latest pixels.
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 {
-	buf = buffer.data();
+	buf = buffer.quantize();
 	w = buffer_width;
 	h = buffer_height;
 }
@@ -171,19 +247,36 @@ bool RayTracer::loadScene(const char* fn)
 	if (!sceneLoaded())
 		return false;
 
+	auto start = std::chrono::steady_clock::now();
+	scene->bakeTransforms();
+	// Mesh BVHs are kept in a file next to the scene between runs.
+	std::unique_ptr<AccelCache> cache;
+	if (traceUI->accelCacheSwitch())
+		cache.reset(new AccelCache(string(fn) + ".accel"));
+	scene->buildObjectAccelerators(cache.get());
+	if (cache)
+		cache->save();
+	if (traceUI->kdSwitch())
+		scene->buildKdTree(traceUI->getMaxDepth(), traceUI->getLeafSize());
+	scene->buildLightBvh(traceUI->getLightCutoff());
+	buildTime = std::chrono::duration<double>(
+	                    std::chrono::steady_clock::now() - start)
+	                    .count();
+
 	return true;
 }
 
 void RayTracer::traceSetup(int w, int h)
 {
-	if (buffer_width != w || buffer_height != h)
+	// The buffer starts out empty even though the size is preset.
+	if (buffer_width != w || buffer_height != h || buffer.empty())
 	{
 		buffer_width = w;
 		buffer_height = h;
-		bufferSize = buffer_width * buffer_height * 3;
-		buffer.resize(bufferSize);
+		buffer.resize(buffer_width, buffer_height);
 	}
-	std::fill(buffer.begin(), buffer.end(), 0);
+	else
+		buffer.clear();
 	m_bBufferReady = true;
 
 	/*
@@ -212,62 +305,584 @@ void RayTracer::traceSetup(int w, int h)
  */
 void RayTracer::traceImage(int w, int h)
 {
+	// A previous render may still hold the buffer.
+	waitRender();
+
 	// Always call traceSetup before rendering anything.
 	traceSetup(w,h);
 
-	// YOUR CODE HERE
-	// FIXME: Start one or more threads for ray tracing
-	//
-	// TIPS: Ideally, the traceImage should be executed asynchronously,
-	//       i.e. returns IMMEDIATELY after working threads are launched.
-	//
-	//       An asynchronous traceImage lets the GUI update your results
-	//       while rendering.
+	TileWork full = fullPass();
+	if (traceUI->progressiveSwitch()) {
+		std::vector<TileWork> passes;
+		for (int stride = COARSEST; stride > 1; stride /= 2)
+			passes.push_back(coarsePass(stride));
+		passes.push_back(std::move(full));
+		startPasses(std::move(passes));
+	} else {
+		startTiles(std::move(full));
+	}
 }
 
-int RayTracer::aaImage()
+// What traceImage() does to each tile when rendering it in full.
+RayTracer::TileWork RayTracer::fullPass()
 {
-	// YOUR CODE HERE
-	// FIXME: Implement Anti-aliasing here
-	//
-	// TIP: samples and aaThresh have been synchronized with TraceUI by
-	//      RayTracer::traceSetup() function
-	return 0;
+	if (thresh > 0.0 && block_size > 1 && !TraceUI::m_debug)
+		return [this](int, int x0, int y0, int x1, int y1) {
+			interpolateTile(x0, y0, x1, y1);
+		};
+
+	// The debugger wants every ray in the scene's cache, which only the
+	// single-ray path fills in.
+	bool packets = traceUI->rayPacketSwitch() && !TraceUI::m_debug;
+	if (traceUI->wavefrontSwitch() && !TraceUI::m_debug) {
+		if (!waveQueues)
+			waveQueues.reset(new WaveQueue[MAX_THREADS]);
+		return [this, packets](int worker, int x0, int y0, int x1, int y1) {
+			traceWavefront(worker, x0, y0, x1, y1, packets);
+		};
+	}
+	return [this, packets](int, int x0, int y0, int x1, int y1) {
+		if (!packets) {
+			for (int j = y0; j < y1; j++)
+				for (int i = x0; i < x1; i++)
+					tracePixel(i, j);
+			return;
+		}
+		double dummy;
+		tracePackets(x0, y0, x1, y1,
+		             [&](int x, int y, ray& r, const isect& i, bool hit) {
+			             glm::dvec3 col = shadeRay(
+			                     r, i, hit, glm::dvec3(1.0,1.0,1.0),
+			                     traceUI->getDepth(), dummy);
+			             setPixel(x, y, sample(col));
+		             });
+	};
+}
+
+// A preview pass for progressive rendering: one pixel in stride x
+// stride is traced and its colour fills the square it starts.  The grid
+// is laid from each tile's corner, so the squares never leave the tile,
+// and each pass's grid contains the last one's, whose samples are not
+// traced again.
+RayTracer::TileWork RayTracer::coarsePass(int stride)
+{
+	return [this, stride](int, int x0, int y0, int x1, int y1) {
+		if (!sceneLoaded())
+			return;
+		int coarser = 2 * stride;
+		for (int j = y0; j < y1; j += stride)
+			for (int i = x0; i < x1; i += stride) {
+				if (stride < COARSEST && (i - x0) % coarser == 0 &&
+				    (j - y0) % coarser == 0)
+					continue;
+				glm::dvec3 col = traceAt(i, j);
+				for (int y = j; y < std::min(j + stride, y1); y++)
+					for (int x = i; x < std::min(i + stride, x1); x++)
+						setPixel(x, y, col);
+			}
+	};
+}
+
+// Sparse sampling for previews: only the corners of each block_size
+// block are traced, and the pixels in between are interpolated from
+// them.  Tiles are whole blocks, so a tile traces its own grid of
+// corners; those on its far edges belong to the next tile's blocks (or
+// lie just outside the image) and are traced again there.
+void RayTracer::interpolateTile(int x0, int y0, int x1, int y1)
+{
+	if (!sceneLoaded())
+		return;
+	int b = block_size;
+	int nx = (x1 - x0 + b - 1) / b, ny = (y1 - y0 + b - 1) / b;
+	std::vector<glm::dvec3> corners((nx + 1) * (ny + 1));
+	for (int j = 0; j <= ny; j++)
+		for (int i = 0; i <= nx; i++)
+			corners[i + j * (nx + 1)] = traceAt(x0 + i * b, y0 + j * b);
+
+	for (int j = 0; j < ny; j++)
+		for (int i = 0; i < nx; i++) {
+			const glm::dvec3* row = &corners[i + j * (nx + 1)];
+			glm::dvec3 c[4] = {row[0], row[1], row[nx + 1], row[nx + 2]};
+			int bx = x0 + i * b, by = y0 + j * b;
+			fillBlock(bx, by, bx + b, by + b, c);
+		}
+}
+
+// Set the pixels of [x0, x1) x [y0, y1) that are in the image, given
+// the colours c of the samples at (x0, y0), (x1, y0), (x0, y1) and
+// (x1, y1).  If those agree within thresh the pixels are interpolated
+// bilinearly; if not, the block is split in four, tracing the samples
+// on the splitting lines, down to single pixels.
+void RayTracer::fillBlock(int x0, int y0, int x1, int y1,
+                          const glm::dvec3 c[4])
+{
+	int w = x1 - x0, h = y1 - y0;
+	if ((w == 1 && h == 1) || spread(c) <= thresh) {
+		for (int j = y0; j < std::min(y1, buffer_height); j++) {
+			double fy = double(j - y0) / h;
+			glm::dvec3 left = (1.0 - fy) * c[0] + fy * c[2];
+			glm::dvec3 right = (1.0 - fy) * c[1] + fy * c[3];
+			for (int i = x0; i < std::min(x1, buffer_width); i++) {
+				double fx = double(i - x0) / w;
+				setPixel(i, j, (1.0 - fx) * left + fx * right);
+			}
+		}
+		return;
+	}
+
+	// A side one pixel long is not split.
+	int xm = w > 1 ? x0 + w / 2 : x1;
+	int ym = h > 1 ? y0 + h / 2 : y1;
+	auto at = [&](int x, int y) {
+		if (y == y0 && (x == x0 || x == x1))
+			return c[x == x0 ? 0 : 1];
+		if (y == y1 && (x == x0 || x == x1))
+			return c[x == x0 ? 2 : 3];
+		return traceAt(x, y);
+	};
+	glm::dvec3 top = at(xm, y0);
+	glm::dvec3 left = at(x0, ym);
+	glm::dvec3 mid = at(xm, ym);
+	glm::dvec3 right = xm < x1 ? at(x1, ym) : mid;
+	glm::dvec3 bottom = ym < y1 ? at(xm, y1) : mid;
+	glm::dvec3 q[4][4] = {{c[0], top, left, mid},
+	                      {top, c[1], mid, right},
+	                      {left, mid, c[2], bottom},
+	                      {mid, right, bottom, c[3]}};
+	fillBlock(x0, y0, xm, ym, q[0]);
+	if (xm < x1)
+		fillBlock(xm, y0, x1, ym, q[1]);
+	if (ym < y1)
+		fillBlock(x0, ym, xm, y1, q[2]);
+	if (xm < x1 && ym < y1)
+		fillBlock(xm, ym, x1, y1, q[3]);
+}
+
+// Camera rays through a block of pixels start at the eye and spread
+// only a little, so they are intersected with the scene as one packet.
+// Everything after that, shading and every secondary ray, is done ray
+// by ray just as in tracePixel(); the image is the same either way.
+void RayTracer::tracePackets(int x0, int y0, int x1, int y1,
+                             const CameraHit& f)
+{
+	if (!sceneLoaded())
+		return;
+
+	RayPacket packet;
+	Camera& camera = scene->getCamera();
+	for (int py = y0; py < y1; py += PACKET_SIZE) {
+		for (int px = x0; px < x1; px += PACKET_SIZE) {
+			int pw = std::min(PACKET_SIZE, x1 - px);
+			int ph = std::min(PACKET_SIZE, y1 - py);
+			packet.clear();
+			for (int j = py; j < py + ph; j++) {
+				for (int i = px; i < px + pw; i++) {
+					ray r(glm::dvec3(0,0,0), glm::dvec3(0,0,0), glm::dvec3(1,1,1), ray::VISIBILITY);
+					camera.rayThrough(double(i)/double(buffer_width),
+					                  double(j)/double(buffer_height), r);
+					packet.add(r);
+				}
+			}
+			int corners[4] = {0, pw - 1, pw * ph - 1, pw * (ph - 1)};
+			packet.bound(corners);
+			scene->intersectPacket(packet);
+
+			for (int k = 0; k < pw * ph; k++)
+				f(px + k % pw, py + k / pw, packet.getRay(k),
+				  packet.getIsect(k), packet.hasHit(k));
+		}
+	}
+}
+
+// Sort key for a secondary ray: the octant of its direction, then the
+// cell of a 16x16x16 grid over the scene that it starts in, with the
+// cells in Morton order so that nearby cells sort near each other.
+namespace {
+uint32_t waveKey(const glm::dvec3& origin, const glm::dvec3& direction,
+                 const BoundingBox& bounds)
+{
+	const int CELL_BITS = 4;
+	glm::dvec3 lo = bounds.getMin(), hi = bounds.getMax();
+	uint32_t key = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		double extent = hi[axis] - lo[axis];
+		double f = extent > 0.0 ? (origin[axis] - lo[axis]) / extent : 0.0;
+		int cell = (int)(f * (1 << CELL_BITS));
+		cell = std::max(0, std::min(cell, (1 << CELL_BITS) - 1));
+		for (int b = 0; b < CELL_BITS; b++)
+			key |= (uint32_t)((cell >> b) & 1) << (3 * b + axis);
+		if (direction[axis] < 0.0)
+			key |= 1u << (3 * CELL_BITS + axis);
+	}
+	return key;
+}
+}
+
+// Trace the pixels of [x0, x1) x [y0, y1) breadth first.  The camera
+// rays go first, as a batch; every reflected and refracted ray they
+// spawn is put in the worker's queue, and once the batch is shaded the
+// queue is sorted, so that rays starting close together and heading the
+// same way (and the shadow rays their shading casts) are traced one
+// after another, and becomes the next batch.
+//
+// Each queued ray carries the product of the kr and kt along its path,
+// so its shaded color is simply added to its pixel; that is the sum
+// traceRay() builds up recursively.
+void RayTracer::traceWavefront(int worker, int x0, int y0, int x1, int y1,
+                               bool packets)
+{
+	if (!sceneLoaded())
+		return;
+
+	WaveQueue& q = waveQueues[worker];
+	int w = x1 - x0;
+	q.colors.assign(w * (y1 - y0), glm::dvec3(0.0, 0.0, 0.0));
+	q.next.clear();
+	const BoundingBox& bounds = scene->bounds();
+
+	// Add the color seen along r, weighted, to pixel, and queue what
+	// it bounces into if depth allows.
+	auto shade = [&](ray& r, const isect& i, bool hit,
+	                 const glm::dvec3& weight, int pixel, int depth) {
+		double length;
+		q.colors[pixel] += weight * shadeRay(r, i, hit, weight, 0, length);
+		if (!hit || depth <= 0)
+			return;
+		Bounce out[2];
+		int n = bounces(r, i, i.getMaterial(), out);
+		for (int k = 0; k < n; k++) {
+			out[k].weight *= weight;
+			q.next.push_back(WaveRay{out[k], pixel,
+			                         waveKey(out[k].origin,
+			                                 out[k].direction, bounds)});
+		}
+	};
+
+	int depth = traceUI->getDepth();
+	glm::dvec3 one(1.0, 1.0, 1.0);
+	auto camera = [&](int x, int y, ray& r, const isect& i, bool hit) {
+		shade(r, i, hit, one, (x - x0) + (y - y0) * w, depth);
+	};
+	if (packets) {
+		tracePackets(x0, y0, x1, y1, camera);
+	} else {
+		for (int j = y0; j < y1; j++) {
+			for (int i = x0; i < x1; i++) {
+				ray r(glm::dvec3(0,0,0), glm::dvec3(0,0,0), one, ray::VISIBILITY);
+				scene->getCamera().rayThrough(double(i)/double(buffer_width),
+				                              double(j)/double(buffer_height), r);
+				isect hit;
+				camera(i, j, r, hit, scene->intersect(r, hit));
+			}
+		}
+	}
+
+	for (depth--; depth >= 0 && !q.next.empty(); depth--) {
+		std::swap(q.current, q.next);
+		q.next.clear();
+		// Stable, so that the sums into each pixel come out the same
+		// every time.
+		std::stable_sort(q.current.begin(), q.current.end(),
+		                 [](const WaveRay& a, const WaveRay& b) {
+			                 return a.key < b.key;
+		                 });
+		for (const WaveRay& wr : q.current) {
+			const Bounce& b = wr.bounce;
+			ray r(b.origin, b.direction, b.weight, b.type);
+			isect i;
+			bool hit = scene->intersect(r, i);
+			shade(r, i, hit, b.weight, wr.pixel, depth);
+		}
+	}
+
+	for (int k = 0; k < (int)q.colors.size(); k++)
+		setPixel(x0 + k % w, y0 + k / w, sample(q.colors[k]));
+}
+
+// Adaptive supersampling of the finished image.  A pixel is refined only
+// if it differs from one of its four neighbours by more than aaThresh in
+// some channel; the others keep the single sample traceImage() gave
+// them.  Which pixels to refine is decided up front from the buffer as
+// it stands, so that the tiles refined first cannot change the decision
+// for their neighbours.  Returns the number of pixels being refined;
+// the refinement itself runs on the tile workers, like traceImage().
+//
+// Tiles are refined in order of their total contrast, highest first, and
+// tiles with nothing to refine are not visited at all.  If a time budget
+// stops the pass early, the roughest parts of the image are the ones
+// that were done.
+//
+// A later round looks at the image again with half the threshold and
+// refines what it picks one level deeper, replacing the pixel's earlier
+// samples.
+int RayTracer::aaImage(int round)
+{
+	waitRender();
+	if (!sceneLoaded() || buffer.empty() || samples <= 1 ||
+	    round > MAX_AA_ROUND)
+		return 0;
+
+	int w = buffer_width, h = buffer_height;
+	double limit = std::ldexp(aaThresh, -round);
+	layoutTiles();
+	std::vector<double> contrast(tilesX * tilesY, 0.0);
+	if (round == 0)
+		aaMask.assign(w * h, 0);
+	else
+		for (auto& m : aaMask)
+			m = m ? 1 : 0;
+	int refined = 0;
+	for (int j = 0; j < h; j++)
+		for (int i = 0; i < w; i++) {
+			// Compared as displayed.
+			glm::dvec3 p = glm::clamp(getPixel(i, j), 0.0, 1.0);
+			glm::dvec3 q[4] = {getPixel(std::max(i - 1, 0), j),
+			                   getPixel(std::min(i + 1, w - 1), j),
+			                   getPixel(i, std::max(j - 1, 0)),
+			                   getPixel(i, std::min(j + 1, h - 1))};
+			double most = 0.0;
+			for (int n = 0; n < 4; n++) {
+				glm::dvec3 d = glm::abs(p - glm::clamp(q[n], 0.0, 1.0));
+				most = std::max(most,
+				                std::max(d[0], std::max(d[1], d[2])));
+			}
+			if (most > limit) {
+				aaMask[i + j * w] = 2;
+				contrast[i / tileSize + j / tileSize * tilesX] += most;
+				refined++;
+			}
+		}
+	if (refined == 0)
+		return 0;
+
+	std::vector<int> order;
+	for (int t = 0; t < (int)contrast.size(); t++)
+		if (contrast[t] > 0)
+			order.push_back(t);
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return contrast[a] > contrast[b];
+	});
+
+	// Cells are split until they are at most 1/samples of a pixel
+	// across.
+	int depth = round;
+	while ((1 << (depth - round)) < samples)
+		depth++;
+	startTiles([this, depth, limit](int, int x0, int y0, int x1, int y1) {
+		for (int j = y0; j < y1; j++)
+			for (int i = x0; i < x1; i++) {
+				if (aaMask[i + j * buffer_width] != 2)
+					continue;
+				// The pixel's square is centred on where its
+				// first sample was taken.
+				double x = i - 0.5, y = j - 0.5;
+				glm::dvec3 c[4] = {traceAt(x, y), traceAt(x + 1, y),
+				                   traceAt(x, y + 1),
+				                   traceAt(x + 1, y + 1)};
+				int traced = 4;
+				glm::dvec3 col =
+				        refine(x, y, 1.0, c, depth, limit, true, traced);
+				setPixel(i, j, col, traced);
+			}
+	}, std::move(order));
+	return refined;
+}
+
+int RayTracer::aaPixelCount() const
+{
+	return (int)std::count_if(aaMask.begin(), aaMask.end(),
+	                          [](unsigned char m) { return m != 0; });
+}
+
+glm::dvec3 RayTracer::traceAt(double x, double y)
+{
+	return trace(x / double(buffer_width), y / double(buffer_height));
+}
+
+// The average colour over the square of side size at (x, y), in pixels,
+// whose corners have colours c (in the order x, x + size; then the same
+// at y + size).  The square is split into four while its corners differ
+// by more than limit and depth allows, sharing the samples on the
+// splitting lines between the quarters.  traced counts the samples.
+glm::dvec3 RayTracer::refine(double x, double y, double size,
+                             const glm::dvec3 c[4], int depth, double limit,
+                             bool split, int& traced)
+{
+	if (depth > 0 && !split)
+		split = spread(c) > limit;
+	if (depth == 0 || !split)
+		return 0.25 * (c[0] + c[1] + c[2] + c[3]);
+
+	double half = 0.5 * size;
+	glm::dvec3 top = traceAt(x + half, y);
+	glm::dvec3 left = traceAt(x, y + half);
+	glm::dvec3 mid = traceAt(x + half, y + half);
+	glm::dvec3 right = traceAt(x + size, y + half);
+	glm::dvec3 bottom = traceAt(x + half, y + size);
+	traced += 5;
+	glm::dvec3 q[4][4] = {{c[0], top, left, mid},
+	                      {top, c[1], mid, right},
+	                      {left, mid, c[2], bottom},
+	                      {mid, right, bottom, c[3]}};
+	return 0.25 * (refine(x, y, half, q[0], depth - 1, limit, false,
+	                      traced) +
+	               refine(x + half, y, half, q[1], depth - 1, limit, false,
+	                      traced) +
+	               refine(x, y + half, half, q[2], depth - 1, limit, false,
+	                      traced) +
+	               refine(x + half, y + half, half, q[3], depth - 1, limit,
+	                      false, traced));
 }
 
 bool RayTracer::checkRender()
 {
-	// YOUR CODE HERE
-	// FIXME: Return true if tracing is done.
-	//        This is a helper routine for GUI.
-	//
-	// TIPS: Introduce an array to track the status of each worker thread.
-	//       This array is maintained by the worker threads.
+	// Each worker decrements this as its last act, so nothing is left
+	// to write to the buffer once it reaches zero, unless another pass
+	// is still to come.
+	return activeWorkers.load(std::memory_order_acquire) == 0 &&
+	       !passesRunning.load(std::memory_order_acquire);
 }
 
 void RayTracer::waitRender()
 {
-	// YOUR CODE HERE
-	// FIXME: Wait until the rendering process is done.
-	//        This function is essential if you are using an asynchronous
-	//        traceImage implementation.
-	//
-	// TIPS: Join all worker threads here.
+	if (passThread.joinable())
+		passThread.join();
+	joinWorkers();
 }
 
+void RayTracer::joinWorkers()
+{
+	for (auto& worker : workers)
+		worker.join();
+	workers.clear();
+}
 
-glm::dvec3 RayTracer::getPixel(int i, int j)
+// Each pass is a full run of the tile scheduler, started once the one
+// before it has finished, from a thread of its own so that this returns
+// at once.  Setting stopTrace ends the current pass early and skips the
+// rest.
+void RayTracer::startPasses(std::vector<TileWork> passes)
 {
-	unsigned char *pixel = buffer.data() + ( i + j * buffer_width ) * 3;
-	return glm::dvec3((double)pixel[0]/255.0, (double)pixel[1]/255.0, (double)pixel[2]/255.0);
+	waitRender();
+	stopTrace = false;
+	passesRunning = true;
+	passThread = std::thread([this](std::vector<TileWork> passes) {
+		for (auto& pass : passes) {
+			if (stopTrace)
+				break;
+			launchTiles(std::move(pass), std::vector<int>());
+			joinWorkers();
+		}
+		passesRunning.store(false, std::memory_order_release);
+	}, std::move(passes));
 }
 
-void RayTracer::setPixel(int i, int j, glm::dvec3 color)
+// Tiles are squares of a whole number of interpolation blocks, at least
+// MIN_TILE pixels across, numbered in scanline order.  Worker k starts
+// on the k-th contiguous share of them; once that runs out it steals
+// from the far end of the other workers' shares, so a worker stuck on
+// expensive tiles does not hold up the rest.
+namespace {
+const int MIN_TILE = 16;
+
+uint64_t packRange(int front, int back)
 {
-	unsigned char *pixel = buffer.data() + ( i + j * buffer_width ) * 3;
+	return (uint64_t)(uint32_t)front | (uint64_t)(uint32_t)back << 32;
+}
+}
+
+bool RayTracer::takeTile(TileQueue& q, bool fromBack, int& tile)
+{
+	uint64_t range = q.range.load(std::memory_order_relaxed);
+	for (;;) {
+		int front = (int)(uint32_t)range;
+		int back = (int)(uint32_t)(range >> 32);
+		if (front >= back)
+			return false;
+		uint64_t next = fromBack ? packRange(front, back - 1)
+		                         : packRange(front + 1, back);
+		if (q.range.compare_exchange_weak(range, next,
+		                                  std::memory_order_relaxed)) {
+			tile = fromBack ? back - 1 : front;
+			return true;
+		}
+	}
+}
+
+void RayTracer::startTiles(TileWork work, std::vector<int> order)
+{
+	waitRender();
+	stopTrace = false;
+	launchTiles(std::move(work), std::move(order));
+}
+
+void RayTracer::layoutTiles()
+{
+	int block = std::max(block_size, 1);
+	tileSize = block * ((MIN_TILE + block - 1) / block);
+	tilesX = (buffer_width + tileSize - 1) / tileSize;
+	tilesY = (buffer_height + tileSize - 1) / tileSize;
+}
+
+// With an order, the tiles in it are dealt out to the workers in turn,
+// so that each works down its own share from the most important tile.
+void RayTracer::launchTiles(TileWork work, std::vector<int> order)
+{
+	layoutTiles();
+	int tiles = order.empty() ? tilesX * tilesY : (int)order.size();
+	int n = std::max(1, std::min((int)threads, OTHER_THREADS));
+	n = std::min(n, std::max(tiles, 1));
+
+	tileWork = std::move(work);
+	numQueues = n;
+	tileQueues.reset(new TileQueue[n]);
+	tileOrder.clear();
+	int front = 0;
+	for (int k = 0; k < n; k++) {
+		int back = front + (tiles - k + n - 1) / n;
+		tileQueues[k].range = packRange(front, back);
+		if (!order.empty())
+			for (int t = k; t < tiles; t += n)
+				tileOrder.push_back(order[t]);
+		front = back;
+	}
+
+	activeWorkers = n;
+	for (int k = 0; k < n; k++)
+		workers.emplace_back(&RayTracer::tileWorker, this, k);
+}
+
+void RayTracer::tileWorker(int id)
+{
+	ray_thread_id = id;
+	int tile;
+	while (!stopTrace) {
+		if (!takeTile(tileQueues[id], false, tile)) {
+			bool stolen = false;
+			for (int k = 1; k < numQueues && !stolen; k++)
+				stolen = takeTile(tileQueues[(id + k) % numQueues], true,
+				                  tile);
+			if (!stolen)
+				break;
+		}
+		if (!tileOrder.empty())
+			tile = tileOrder[tile];
+		int x0 = tile % tilesX * tileSize;
+		int y0 = tile / tilesX * tileSize;
+		tileWork(id, x0, y0, std::min(x0 + tileSize, buffer_width),
+		         std::min(y0 + tileSize, buffer_height));
+	}
+	activeWorkers.fetch_sub(1, std::memory_order_release);
+}
 
-	pixel[0] = (int)( 255.0 * color[0]);
-	pixel[1] = (int)( 255.0 * color[1]);
-	pixel[2] = (int)( 255.0 * color[2]);
+
+glm::dvec3 RayTracer::getPixel(int i, int j)
+{
+	return buffer.get(i, j);
+}
+
+void RayTracer::setPixel(int i, int j, glm::dvec3 color, int samples)
+{
+	buffer.set(i, j, color, samples);
 }
 
@@ -5,10 +5,16 @@
 
 // The main ray tracer.
 
+#include <stdint.h>
 #include <time.h>
 #include <glm/vec3.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <queue>
 #include <thread>
+#include <vector>
+#include "frameBuffer.h"
 #include "scene/cubeMap.h"
 #include "scene/ray.h"
 
@@ -33,12 +39,27 @@ public:
 	                    double& length);
 
 	glm::dvec3 getPixel(int i, int j);
-	void setPixel(int i, int j, glm::dvec3 color);
+	// color is the mean of samples samples.
+	void setPixel(int i, int j, glm::dvec3 color, int samples = 1);
 	void getBuffer(unsigned char*& buf, int& w, int& h);
+	// Row j of the image as traced, for float image files: 3 floats a
+	// pixel, clamped only if samples are.
+	void getFloatRow(int j, float* rgb) const;
+	// Whether each sample is clamped to [0, 1] as it is traced, as it
+	// must be for 8-bit output to average what is displayed.  Turn it
+	// off only when the image is to be written as floats.
+	void setClampSamples(bool clamp) { clampSamples = clamp; }
 	double aspectRatio();
 
 	void traceImage(int w, int h);
-	int aaImage();
+	// Round 0 is the antialiasing pass; later rounds, for spending what
+	// is left of a time budget, each halve the threshold and double the
+	// samples across.  Returns the number of pixels the round refines,
+	// 0 past MAX_AA_ROUND.
+	int aaImage(int round = 0);
+	// Pixels refined by any round since the last round 0.
+	int aaPixelCount() const;
+	static const int MAX_AA_ROUND = 6;
 	bool checkRender();
 	void waitRender();
 
@@ -46,26 +67,124 @@ public:
 
 	bool loadScene(const char* fn);
 	bool sceneLoaded() { return scene != 0; }
+	// Seconds spent building acceleration structures in loadScene().
+	double getBuildTime() const { return buildTime; }
 
 	void setReady(bool ready) { m_bBufferReady = ready; }
 	bool isReady() const { return m_bBufferReady; }
 
 	const Scene& getScene() { return *scene; }
 
-	bool stopTrace;
+	std::atomic<bool> stopTrace;
 
 private:
 	glm::dvec3 trace(double x, double y);
+	// trace() at (x, y) in pixels.
+	glm::dvec3 traceAt(double x, double y);
+	// Adaptive supersampling of one square; split forces one level of
+	// subdivision whatever the corners hold.
+	glm::dvec3 refine(double x, double y, double size,
+	                  const glm::dvec3 c[4], int depth, double limit,
+	                  bool split,
+	                  int& traced);
+	// A traced sample as it is stored.
+	glm::dvec3 sample(const glm::dvec3& color) const;
+	glm::dvec3 shadeRay(ray& r, const isect& i, bool hit,
+	                    const glm::dvec3& thresh, int depth,
+	                    double& length);
 
-	std::vector<unsigned char> buffer;
+	// A secondary ray to trace from a hit, and the factor its color is
+	// weighted by.
+	struct Bounce {
+		glm::dvec3 origin;
+		glm::dvec3 direction;
+		glm::dvec3 weight;
+		ray::RayType type;
+	};
+	int bounces(const ray& r, const isect& i, const Material& m,
+	            Bounce out[2]) const;
+
+	// Called with the camera ray through pixel (x, y) and what it hit.
+	typedef std::function<void(int x, int y, ray& r, const isect& i,
+	                           bool hit)>
+	        CameraHit;
+
+	// Camera rays are traced in packets of up to PACKET_SIZE x
+	// PACKET_SIZE pixels.
+	static const int PACKET_SIZE = 8;
+	void tracePackets(int x0, int y0, int x1, int y1, const CameraHit& f);
+
+	// Interpolation between block corners, when thresh is set.
+	void interpolateTile(int x0, int y0, int x1, int y1);
+	void fillBlock(int x0, int y0, int x1, int y1, const glm::dvec3 c[4]);
+
+	// Breadth-first tracing, one bounce of a whole tile at a time.
+	struct WaveRay {
+		Bounce bounce; // weight is that of the whole path
+		int pixel;     // index within the tile
+		uint32_t key;  // sort order
+	};
+	struct WaveQueue {
+		std::vector<WaveRay> current;
+		std::vector<WaveRay> next;
+		std::vector<glm::dvec3> colors;
+	};
+	void traceWavefront(int worker, int x0, int y0, int x1, int y1,
+	                    bool packets);
+	std::unique_ptr<WaveQueue[]> waveQueues; // one per worker
+
+	// Called by a worker for every pixel in [x0, x1) x [y0, y1).
+	typedef std::function<void(int worker, int x0, int y0, int x1, int y1)>
+	        TileWork;
+
+	// Split the buffer into tiles and start threads workers on them,
+	// returning at once; see checkRender() and waitRender().  If order
+	// is not empty, only the tiles it lists are worked on, roughly in
+	// its order.
+	void startTiles(TileWork work, std::vector<int> order = {});
+	// startTiles() for each of passes in turn, returning at once.
+	void startPasses(std::vector<TileWork> passes);
+	void layoutTiles();
+	void launchTiles(TileWork work, std::vector<int> order);
+	void joinWorkers();
+	void tileWorker(int id);
+
+	TileWork fullPass();
+	// Progressive rendering starts with a pass that traces one pixel in
+	// COARSEST x COARSEST, then halves the stride down to the full pass.
+	static const int COARSEST = 4;
+	TileWork coarsePass(int stride);
+
+	// Each worker owns a contiguous run of tiles [front, back), packed
+	// into one word so that the owner (taking from the front) and
+	// thieves (taking from the back) can both claim a tile with a
+	// single compare-and-swap.
+	struct TileQueue {
+		std::atomic<uint64_t> range;
+	};
+	static bool takeTile(TileQueue& q, bool fromBack, int& tile);
+
+	std::vector<std::thread> workers;
+	std::thread passThread; // runs startPasses()
+	std::atomic<bool> passesRunning;
+	std::unique_ptr<TileQueue[]> tileQueues;
+	std::atomic<int> activeWorkers;
+	TileWork tileWork;
+	int numQueues;
+	int tileSize, tilesX, tilesY;
+	std::vector<int> tileOrder; // tile for each queue slot, if reordered
+
+	FrameBuffer buffer;
 	int buffer_width, buffer_height;
-	int bufferSize;
 	unsigned int threads;
 	int block_size;
 	double thresh;
 	double aaThresh;
 	int samples;
+	std::vector<unsigned char> aaMask; // 2: refine this round, 1: earlier
+	bool clampSamples = true;
 	std::unique_ptr<Scene> scene;
+	double buildTime = 0.0;
 
 	bool m_bBufferReady;
 
@@ -54,7 +54,6 @@ bool Box::intersectLocal(ray& r, isect& i) const
         
         i.setT(bestT);
         i.setObject(this);
-		i.setMaterial(this->getMaterial());
 
 		//glm::dvec3 intersect_point = r.at((float)i.t);
 		glm::dvec3 intersect_point = r.at(i);
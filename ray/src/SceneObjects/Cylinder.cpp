@@ -9,7 +9,6 @@ bool Cylinder::intersectLocal(ray& r, isect& i) const
 {
 	// FIXME: check these suspicious initialization.
 	i.setObject(this);
-	i.setMaterial(this->getMaterial());
 
 	if( intersectCaps( r, i ) ) {
 		isect ii;
@@ -17,7 +16,6 @@ bool Cylinder::intersectLocal(ray& r, isect& i) const
 			if( ii.getT() < i.getT() ) {
 				i = ii;
 				i.setObject(this);
-				i.setMaterial(this->getMaterial());
 			}
 		}
 		return true;
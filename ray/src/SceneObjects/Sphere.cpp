@@ -25,7 +25,6 @@ bool Sphere::intersectLocal(ray& r, isect& i) const
 	}
 
 	i.setObject(this);
-	i.setMaterial(this->getMaterial());
 
 	double t1 = b - discriminant;
 
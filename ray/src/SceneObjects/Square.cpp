@@ -32,7 +32,6 @@ bool Square::intersectLocal(ray& r, isect& i) const
 	}
 
 	i.setObject(this);
-	i.setMaterial(this->getMaterial());
 	i.setT(t);
 	if( d[2] > 0.0 ) {
 		i.setN(glm::dvec3( 0.0, 0.0, -1.0 ));
@@ -4,50 +4,52 @@
 #include <string.h>
 #include <algorithm>
 #include <cmath>
+#include "../scene/accelCache.h"
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
 
 using namespace std;
 
-Trimesh::~Trimesh()
+Trimesh::Mesh::~Mesh()
 {
 	for (auto m : materials)
 		delete m;
-	for (auto f : faces)
-		delete f;
+}
+
+Trimesh::~Trimesh()
+{
 }
 
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex(const glm::dvec3& v)
 {
-	vertices.emplace_back(v);
+	mesh->vertices.emplace_back(v);
 }
 
 void Trimesh::addMaterial(Material* m)
 {
-	materials.emplace_back(m);
+	mesh->materials.emplace_back(m);
 }
 
 void Trimesh::addNormal(const glm::dvec3& n)
 {
-	normals.emplace_back(n);
+	mesh->normals.emplace_back(n);
+	mesh->vertNorms = true;
 }
 
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace(int a, int b, int c)
 {
-	int vcnt = vertices.size();
+	int vcnt = mesh->vertices.size();
 
 	if (a >= vcnt || b >= vcnt || c >= vcnt)
 		return false;
 
-	TrimeshFace* newFace = new TrimeshFace(
-	        scene, new Material(*this->material), this, a, b, c);
-	newFace->setTransform(this->transform);
-	if (!newFace->degen)
-		faces.push_back(newFace);
-	else
-		delete newFace;
+	// Faces with coincident vertices can never be hit; leave them out.
+	const Vertices& v = mesh->vertices;
+	if (v[a] == v[b] || v[a] == v[c] || v[b] == v[c])
+		return true;
+	mesh->faces.push_back(Face{{a, b, c}});
 
 	// Don't add faces to the scene's object list so we can cull by bounding
 	// box
@@ -58,62 +60,412 @@ bool Trimesh::addFace(int a, int b, int c)
 // they are the right number.
 const char* Trimesh::doubleCheck()
 {
-	if (!materials.empty() && materials.size() != vertices.size())
+	const Mesh& m = *mesh;
+	if (!m.materials.empty() && m.materials.size() != m.vertices.size())
 		return "Bad Trimesh: Wrong number of materials.";
-	if (!normals.empty() && normals.size() != vertices.size())
+	if (!m.normals.empty() && m.normals.size() != m.vertices.size())
 		return "Bad Trimesh: Wrong number of normals.";
 
 	return 0;
 }
 
+namespace {
+// FNV-1a, folded over raw bytes.
+void hashBytes(size_t& h, const void* data, size_t len)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	for (size_t k = 0; k < len; k++) {
+		h ^= p[k];
+		h *= 1099511628211ULL;
+	}
+}
+}
+
+void Trimesh::bakeTransform()
+{
+	// A shared mesh has to stay in its own space for the other
+	// instances, and a mirroring transform would turn the face normals,
+	// which follow the winding, inside out.
+	if (mesh.use_count() > 1 || transform->isIdentity() ||
+	    glm::determinant(glm::dmat3x3(transform->transform())) <= 0.0)
+		return;
+
+	for (auto& v : mesh->vertices)
+		v = transform->localToGlobalCoords(v);
+	// Left unnormalized, so that interpolating them and normalizing gives
+	// the same normal as interpolating in local space did.
+	const glm::dmat3x3& normi = transform->normalTransform();
+	for (auto& n : mesh->normals)
+		n = normi * n;
+	transform = &scene->transformRoot;
+	ComputeBoundingBox();
+}
+
+void Trimesh::buildAccelerator(AccelCache* cache)
+{
+	if (mesh->bvh)
+		return;
+
+	double splitBudget = traceUI->sbvhSwitch() ? traceUI->getSbvhBudget()
+	                                           : 0.0;
+	// A mesh that would fit in a pack or two is quicker to test face by
+	// face.
+	int packWidth = traceUI->trianglePackSwitch() &&
+	                                mesh->faces.size() > 2 * TrianglePack::WIDTH
+	                        ? TrianglePack::WIDTH
+	                        : 1;
+	// The tree depends on the split budget and leaf sizing as well as the
+	// geometry.
+	uint64_t key = 0;
+	if (cache) {
+		size_t h = geometryHash();
+		hashBytes(h, &splitBudget, sizeof(splitBudget));
+		hashBytes(h, &packWidth, sizeof(packWidth));
+		key = h;
+	}
+	const char* data;
+	size_t size;
+	if (cache && cache->find(key, data, size))
+		mesh->bvh.reset(Bvh<Mesh>::load(*mesh, data, size,
+		                                 cache->mapping()));
+	if (!mesh->bvh) {
+		mesh->bvh.reset(new Bvh<Mesh>(*mesh, traceUI->getThreads(),
+		                              splitBudget, packWidth));
+		if (cache)
+			cache->store(key, mesh->bvh->serialize());
+	}
+	if (packWidth > 1)
+		mesh->buildPacks();
+}
+
+size_t Trimesh::geometryHash() const
+{
+	size_t h = 14695981039346656037ULL;
+	const Mesh& m = *mesh;
+	hashBytes(h, m.vertices.data(), m.vertices.size() * sizeof(glm::dvec3));
+	hashBytes(h, m.normals.data(), m.normals.size() * sizeof(glm::dvec3));
+	hashBytes(h, m.faces.data(), m.faces.size() * sizeof(Face));
+	return h;
+}
+
+bool Trimesh::canShareWith(const Trimesh& other) const
+{
+	const Mesh& a = *mesh;
+	const Mesh& b = *other.mesh;
+	if (!a.materials.empty() || !b.materials.empty())
+		return false;
+	if (a.vertNorms != b.vertNorms || a.vertices != b.vertices ||
+	    a.normals != b.normals || a.faces.size() != b.faces.size())
+		return false;
+	for (size_t k = 0; k < a.faces.size(); k++)
+		for (int v = 0; v < 3; v++)
+			if (a.faces[k][v] != b.faces[k][v])
+				return false;
+	return true;
+}
+
 bool Trimesh::intersectLocal(ray& r, isect& i) const
 {
 	bool have_one = false;
-	for (auto face : faces) {
-		isect cur;
-		if (face->intersectLocal(r, cur)) {
-			if (!have_one || (cur.getT() < i.getT())) {
-				i = cur;
-				have_one = true;
+	if (mesh->bvh) {
+		if (traceUI->wideBvhSwitch())
+			have_one = mesh->bvh->intersectWide(r, i);
+		else
+			have_one = mesh->bvh->intersect(r, i);
+	} else {
+		for (int k = 0; k < mesh->primitiveCount(); k++) {
+			isect cur;
+			if (mesh->intersectPrimitive(k, r, cur)) {
+				if (!have_one || (cur.getT() < i.getT())) {
+					i = cur;
+					have_one = true;
+				}
 			}
 		}
 	}
-	if (!have_one)
+	if (!have_one) {
 		i.setT(1000.0);
-	return have_one;
+		return false;
+	}
+	// The faces belong to the (possibly shared) mesh; report the hit
+	// against this instance so that its own material applies.
+	i.setObject(this);
+	return true;
+}
+
+void Trimesh::intersectPacketLocal(RayPacket& packet) const
+{
+	if (!mesh->bvh) {
+		Geometry::intersectPacketLocal(packet);
+		return;
+	}
+	uint64_t hits = mesh->bvh->intersectPacket(packet);
+	for (int k = 0; hits; k++, hits >>= 1)
+		if (hits & 1)
+			packet.getIsect(k).setObject(this);
+}
+
+// Shadow rays only need to know whether any face is in the way, so the
+// first face found ends the search unless it lets light through.  The
+// faces crossed are remembered then, since spatial splits may put a face
+// in more than one leaf and its kt must only count once.
+bool Trimesh::occludeLocal(ray& r, double tMax, glm::dvec3& atten) const
+{
+	const Mesh& m = *mesh;
+	bool opaque = m.materials.empty() && !getMaterial().Trans();
+	std::vector<int> crossed;
+	auto blocks = [&](int k, double t, double u, double v) {
+		if (opaque)
+			return true;
+		if (std::find(crossed.begin(), crossed.end(), k) != crossed.end())
+			return false;
+		crossed.push_back(k);
+		isect i;
+		i.setObject(this);
+		i.setPrimitive(k);
+		i.setT(t);
+		i.setBary(1.0 - u - v, u, v);
+		i.setUVCoordinates(glm::dvec2(u, v));
+		Material mat = getMaterialAt(i);
+		if (!mat.Trans())
+			return true;
+		atten *= mat.kt(i);
+		return false;
+	};
+	if (m.bvh)
+		return m.bvh->anyHit(r, tMax,
+		                     [&](int first, const int32_t* ids, int count) {
+			                     return m.hitLeaf(first, ids, count, r,
+			                                      tMax, blocks);
+		                     });
+	for (int k = 0; k < m.primitiveCount(); k++) {
+		double t, u, v;
+		if (m.hitPrimitive(k, r, t, u, v) && t < tMax && blocks(k, t, u, v))
+			return true;
+	}
+	return false;
+}
+
+// Per-vertex materials are interpolated across the face that was hit;
+// otherwise the whole mesh has this instance's material.
+Material Trimesh::getMaterialAt(const isect& i) const
+{
+	const Mesh& m = *mesh;
+	if (m.materials.empty() || i.getPrimitive() < 0)
+		return getMaterial();
+	const Face& face = m.faces[i.getPrimitive()];
+	glm::dvec3 bary = i.getBary();
+	Material mat = bary[0] * *m.materials[face[0]];
+	mat += bary[1] * *m.materials[face[1]];
+	mat += bary[2] * *m.materials[face[2]];
+	return mat;
+}
+
+void Trimesh::Mesh::primitiveBounds(int k, glm::dvec3& bmin,
+                                    glm::dvec3& bmax) const
+{
+	const Face& face = faces[k];
+	const glm::dvec3& a = vertices[face[0]];
+	const glm::dvec3& b = vertices[face[1]];
+	const glm::dvec3& c = vertices[face[2]];
+	bmin = glm::min(glm::min(a, b), c);
+	bmax = glm::max(glm::max(a, b), c);
+}
+
+void Trimesh::Mesh::buildPacks()
+{
+	const int width = TrianglePack::WIDTH;
+	packs.clear();
+	leafPacks.assign(bvh->entryCount(), -1);
+	bvh->forEachLeaf([&](int first, const int32_t* ids, int count) {
+		leafPacks[first] = (int)packs.size();
+		for (int k = 0; k < count; k += width) {
+			int n = std::min(width, count - k);
+			glm::dvec3 bmin, bmax, lo, hi;
+			primitiveBounds(ids[k], bmin, bmax);
+			for (int lane = 1; lane < n; lane++) {
+				primitiveBounds(ids[k + lane], lo, hi);
+				bmin = glm::min(bmin, lo);
+				bmax = glm::max(bmax, hi);
+			}
+			TrianglePack pack(0.5 * (bmin + bmax));
+			for (int lane = 0; lane < n; lane++) {
+				const Face& face = faces[ids[k + lane]];
+				pack.setLane(lane, vertices[face[0]],
+				             vertices[face[1]], vertices[face[2]],
+				             ids[k + lane]);
+			}
+			packs.push_back(pack);
+		}
+	});
+}
+
+// The packs only narrow each leaf down to the faces the ray might hit;
+// those are then intersected exactly, in the leaf's order, so the result
+// is the same as without them.
+bool Trimesh::Mesh::intersectLeaf(int first, const int32_t* ids, int count,
+                                  ray& r, double tMax, isect& i) const
+{
+	bool found = false;
+	auto test = [&](int k) {
+		isect hit;
+		if (intersectPrimitive(k, r, hit) && hit.getT() < tMax) {
+			i = hit;
+			tMax = hit.getT();
+			found = true;
+		}
+	};
+	if (packs.empty()) {
+		for (int k = 0; k < count; k++)
+			test(ids[k]);
+		return found;
+	}
+
+	const TrianglePack* pack = &packs[leafPacks[first]];
+	for (int k = 0; k < count; k += TrianglePack::WIDTH, pack++) {
+		int lanes = pack->candidates(r.getPosition(), r.getDirection(),
+		                             RAY_EPSILON, tMax);
+		for (int lane = 0; lanes; lane++, lanes >>= 1)
+			if (lanes & 1)
+				test(pack->id[lane]);
+	}
+	return found;
 }
 
-bool TrimeshFace::intersect(ray& r, isect& i) const
+template <typename F>
+bool Trimesh::Mesh::hitLeaf(int first, const int32_t* ids, int count,
+                            const ray& r, double tMax, F f) const
 {
-	return intersectLocal(r, i);
+	double t, u, v;
+	if (packs.empty()) {
+		for (int k = 0; k < count; k++)
+			if (hitPrimitive(ids[k], r, t, u, v) && t < tMax &&
+			    f(ids[k], t, u, v))
+				return true;
+		return false;
+	}
+
+	const TrianglePack* pack = &packs[leafPacks[first]];
+	for (int k = 0; k < count; k += TrianglePack::WIDTH, pack++) {
+		int lanes = pack->candidates(r.getPosition(), r.getDirection(),
+		                             RAY_EPSILON, tMax);
+		for (int lane = 0; lanes; lane++, lanes >>= 1) {
+			int face = pack->id[lane];
+			if ((lanes & 1) && hitPrimitive(face, r, t, u, v) &&
+			    t < tMax && f(face, t, u, v))
+				return true;
+		}
+	}
+	return false;
 }
 
 // Intersect ray r with the triangle abc.  If it hits returns true,
 // and put the parameter in t and the barycentric coordinates of the
 // intersection in u (alpha) and v (beta).
-bool TrimeshFace::intersectLocal(ray& r, isect& i) const
+bool Trimesh::Mesh::hitPrimitive(int k, const ray& r, double& t, double& u,
+                                 double& v) const
 {
-	// YOUR CODE HERE
-	//
-	// FIXME: Add ray-trimesh intersection
+	// Moller-Trumbore: solve o + t d = a + u (b - a) + v (c - a).
+	const Face& face = faces[k];
+	const glm::dvec3& a = vertices[face[0]];
+	const glm::dvec3& b = vertices[face[1]];
+	const glm::dvec3& c = vertices[face[2]];
+	glm::dvec3 d = r.getDirection();
 
-	return false;
+	glm::dvec3 e1 = b - a;
+	glm::dvec3 e2 = c - a;
+	glm::dvec3 pvec = glm::cross(d, e2);
+	double det = glm::dot(e1, pvec);
+	if (det == 0.0)
+		return false;
+	double invDet = 1.0 / det;
+
+	glm::dvec3 tvec = r.getPosition() - a;
+	u = glm::dot(tvec, pvec) * invDet;
+	if (u < 0.0 || u > 1.0)
+		return false;
+
+	glm::dvec3 qvec = glm::cross(tvec, e1);
+	v = glm::dot(d, qvec) * invDet;
+	if (v < 0.0 || u + v > 1.0)
+		return false;
+
+	t = glm::dot(e2, qvec) * invDet;
+	return t > RAY_EPSILON;
+}
+
+bool Trimesh::Mesh::intersectPrimitive(int k, ray& r, isect& i) const
+{
+	double t, u, v;
+	if (!hitPrimitive(k, r, t, u, v))
+		return false;
+
+	const Face& face = faces[k];
+	double alpha = 1.0 - u - v;
+	i.setPrimitive(k);
+	i.setT(t);
+	i.setBary(alpha, u, v);
+	i.setUVCoordinates(glm::dvec2(u, v));
+
+	if (vertNorms) {
+		i.setN(glm::normalize(alpha * normals[face[0]] +
+		                      u * normals[face[1]] + v * normals[face[2]]));
+	} else {
+		const glm::dvec3& a = vertices[face[0]];
+		i.setN(glm::normalize(glm::cross(vertices[face[1]] - a,
+		                                 vertices[face[2]] - a)));
+	}
+	return true;
+}
+
+// Bounds of the part of the triangle with lo <= p[axis] <= hi: its
+// corners inside that slab plus the points where its edges cross the
+// slab's planes.
+bool Trimesh::Mesh::clipPrimitive(int k, int axis, double lo, double hi,
+                                  glm::dvec3& bmin, glm::dvec3& bmax) const
+{
+	const Face& face = faces[k];
+	bool found = false;
+	auto include = [&](const glm::dvec3& p) {
+		bmin = found ? glm::min(bmin, p) : p;
+		bmax = found ? glm::max(bmax, p) : p;
+		found = true;
+	};
+	for (int e = 0; e < 3; e++) {
+		const glm::dvec3& a = vertices[face[e]];
+		const glm::dvec3& b = vertices[face[(e + 1) % 3]];
+		if (a[axis] >= lo && a[axis] <= hi)
+			include(a);
+		for (double plane : {lo, hi}) {
+			if ((a[axis] < plane) != (b[axis] < plane)) {
+				double t = (plane - a[axis]) / (b[axis] - a[axis]);
+				glm::dvec3 p = a + t * (b - a);
+				p[axis] = plane;
+				include(p);
+			}
+		}
+	}
+	return found;
 }
 
 // Once all the verts and faces are loaded, per vertex normals can be
 // generated by averaging the normals of the neighboring faces.
 void Trimesh::generateNormals()
 {
+	Vertices& vertices = mesh->vertices;
+	Normals& normals = mesh->normals;
 	int cnt = vertices.size();
 	normals.resize(cnt);
 	std::vector<int> numFaces(cnt, 0);
 
-	for (auto face : faces) {
-		glm::dvec3 faceNormal = face->getNormal();
+	for (const Face& face : mesh->faces) {
+		glm::dvec3 faceNormal = glm::normalize(
+		        glm::cross(vertices[face[1]] - vertices[face[0]],
+		                   vertices[face[2]] - vertices[face[0]]));
 
 		for (int i = 0; i < 3; ++i) {
-			normals[(*face)[i]] += faceNormal;
-			++numFaces[(*face)[i]];
+			normals[face[i]] += faceNormal;
+			++numFaces[face[i]];
 		}
 	}
 
@@ -122,6 +474,6 @@ void Trimesh::generateNormals()
 			normals[i] /= numFaces[i];
 	}
 
-	vertNorms = true;
+	mesh->vertNorms = true;
 }
 
@@ -5,42 +5,98 @@
 #include <memory>
 #include <vector>
 
+#include "../scene/bvh.h"
 #include "../scene/kdTree.h"
 #include "../scene/material.h"
 #include "../scene/ray.h"
 #include "../scene/scene.h"
+#include "../scene/trianglePack.h"
 
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/vec3.hpp>
 
-class TrimeshFace;
-
 class Trimesh : public MaterialSceneObject {
-	friend class TrimeshFace;
 	typedef std::vector<glm::dvec3> Normals;
 	typedef std::vector<glm::dvec3> Vertices;
-	typedef std::vector<TrimeshFace *> Faces;
 	typedef std::vector<Material *> Materials;
 
-	Vertices vertices;
-	Faces faces;
-	Normals normals;
-	Materials materials;
+public:
+	// A triangle, as the indices of its three vertices.  Its material
+	// is the mesh's (or interpolated from the per-vertex materials) and
+	// its normal is computed when it is hit, so this is all a face needs.
+	struct Face {
+		int ids[3];
+
+		int operator[](int k) const { return ids[k]; }
+	};
+	typedef std::vector<Face> Faces;
+
+	// Everything about a mesh that does not depend on where it is placed:
+	// vertices, per-vertex attributes, faces and the BVH over them.  Meshes
+	// with identical contents share one Mesh (the bottom level), and each
+	// Trimesh is just an instance of it under its own TransformNode, seen
+	// by the scene's kd-tree (the top level).
+	//
+	// The faces are the primitives of the BVH, which refers to them by
+	// their index in faces.  Each BVH leaf's faces may also be copied
+	// into packs, for testing several faces at once with SIMD.
+	struct Mesh {
+		Vertices vertices;
+		Faces faces;
+		Normals normals;
+		Materials materials;
+		bool vertNorms = false;
+		std::unique_ptr<Bvh<Mesh>> bvh;
+		std::vector<TrianglePack> packs;
+		std::vector<int32_t> leafPacks; // first pack of the leaf at entry
+
+		~Mesh();
+
+		// Pack the faces of every BVH leaf.
+		void buildPacks();
+
+		int primitiveCount() const { return (int)faces.size(); }
+		void primitiveBounds(int k, glm::dvec3 &bmin,
+		                     glm::dvec3 &bmax) const;
+		// Whether ray r hits face k, in the mesh's coordinates, and if
+		// so where: at distance t and barycentric coordinates u, v.
+		bool hitPrimitive(int k, const ray &r, double &t, double &u,
+		                  double &v) const;
+		// Intersect ray r with face k, in the mesh's coordinates.  Sets
+		// everything in i except the object.
+		bool intersectPrimitive(int k, ray &r, isect &i) const;
+		// Call f(k, t, u, v) for every face k of a BVH leaf that r hits
+		// closer than tMax, as hitPrimitive() finds it, until f returns
+		// true.  Returns whether it did.
+		template <typename F>
+		bool hitLeaf(int first, const int32_t *ids, int count,
+		             const ray &r, double tMax, F f) const;
+		bool intersectLeaf(int first, const int32_t *ids, int count,
+		                   ray &r, double tMax, isect &i) const;
+		// For spatial splits in the BVH: the bounds of the part of face
+		// k between lo and hi along axis.  False if there is none.
+		bool clipPrimitive(int k, int axis, double lo, double hi,
+		                   glm::dvec3 &bmin, glm::dvec3 &bmax) const;
+	};
+
+private:
+	std::shared_ptr<Mesh> mesh;
 	BoundingBox localBounds;
 
 public:
 	Trimesh(Scene *scene, Material *mat, TransformNode *transform)
 	        : MaterialSceneObject(scene, mat),
+	          mesh(std::make_shared<Mesh>()),
 	          displayListWithMaterials(0),
 	          displayListWithoutMaterials(0)
 	{
 		this->transform = transform;
-		vertNorms = false;
 	}
 
-	bool vertNorms;
-
 	bool intersectLocal(ray &r, isect &i) const;
+	void intersectPacketLocal(RayPacket &packet) const;
+	bool occludeLocal(ray &r, double tMax, glm::dvec3 &atten) const;
+	Material getMaterialAt(const isect &i) const;
 
 	~Trimesh();
 
@@ -54,11 +110,29 @@ public:
 
 	void generateNormals();
 
+	// A mesh instanced by no other Trimesh has its vertices and normals
+	// moved into world space.
+	void bakeTransform();
+
+	// Build the per-mesh BVH over the faces, unless an instance sharing
+	// this mesh already has or cache holds one for identical geometry.
+	// intersectLocal falls back to testing every face until then.
+	void buildAccelerator(AccelCache *cache);
+
+	// Hash of the vertices, normals and faces, for finding identical
+	// meshes.  Meshes with per-vertex materials are never shared.
+	size_t geometryHash() const;
+	bool canShareWith(const Trimesh &other) const;
+
+	// Drop this mesh's own geometry and instance other's instead.
+	void shareMesh(const Trimesh &other) { mesh = other.mesh; }
+
 	bool hasBoundingBoxCapability() const { return true; }
 
 	BoundingBox ComputeLocalBoundingBox()
 	{
 		BoundingBox localbounds;
+		const Vertices &vertices = mesh->vertices;
 		if (vertices.size() == 0)
 			return localbounds;
 		localbounds.setMax(vertices[0]);
@@ -82,73 +156,4 @@ protected:
 	mutable int displayListWithoutMaterials;
 };
 
-class TrimeshFace : public MaterialSceneObject {
-	Trimesh *parent;
-	int ids[3];
-	glm::dvec3 normal;
-	double dist;
-
-public:
-	TrimeshFace(Scene *scene, Material *mat, Trimesh *parent, int a, int b,
-	            int c)
-	        : MaterialSceneObject(scene, mat)
-	{
-		this->parent = parent;
-		ids[0]       = a;
-		ids[1]       = b;
-		ids[2]       = c;
-
-		// Compute the face normal here, not on the fly
-		glm::dvec3 a_coords = parent->vertices[a];
-		glm::dvec3 b_coords = parent->vertices[b];
-		glm::dvec3 c_coords = parent->vertices[c];
-
-		glm::dvec3 vab = (b_coords - a_coords);
-		glm::dvec3 vac = (c_coords - a_coords);
-		glm::dvec3 vcb = (b_coords - c_coords);
-
-		if (glm::length(vab) == 0.0 || glm::length(vac) == 0.0 ||
-		    glm::length(vcb) == 0.0)
-			degen = true;
-		else {
-			degen  = false;
-			normal = glm::cross(b_coords - a_coords,
-			                    c_coords - a_coords);
-			normal = glm::normalize(normal);
-			dist   = glm::dot(normal, a_coords);
-		}
-		localbounds = ComputeLocalBoundingBox();
-		bounds      = localbounds;
-	}
-
-	BoundingBox localbounds;
-	bool degen;
-
-	int operator[](int i) const { return ids[i]; }
-
-	glm::dvec3 getNormal() { return normal; }
-
-	bool intersect(ray &r, isect &i) const;
-	bool intersectLocal(ray &r, isect &i) const;
-
-	bool hasBoundingBoxCapability() const { return true; }
-
-	BoundingBox ComputeLocalBoundingBox()
-	{
-		BoundingBox localbounds;
-		localbounds.setMax(glm::max(parent->vertices[ids[0]],
-		                            parent->vertices[ids[1]]));
-		localbounds.setMin(glm::min(parent->vertices[ids[0]],
-		                            parent->vertices[ids[1]]));
-
-		localbounds.setMax(glm::max(parent->vertices[ids[2]],
-		                            localbounds.getMax()));
-		localbounds.setMin(glm::min(parent->vertices[ids[2]],
-		                            localbounds.getMin()));
-		return localbounds;
-	}
-
-	const BoundingBox &getBoundingBox() const { return localbounds; }
-};
-
 #endif // TRIMESH_H__
@@ -0,0 +1,124 @@
+#include "hdrimage.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+using std::string;
+
+namespace {
+// A shared exponent and an 8-bit mantissa for each channel; channels
+// below 0, infinite or NaN are written as 0.
+void toRGBE(const float* in, unsigned char* rgbe)
+{
+	float rgb[3];
+	for (int c = 0; c < 3; c++)
+		rgb[c] = std::isfinite(in[c]) ? std::max(in[c], 0.0f) : 0.0f;
+	float v = std::max(rgb[0], std::max(rgb[1], rgb[2]));
+	if (!(v > 1.0e-32f)) {
+		rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+		return;
+	}
+	int e;
+	float scale = std::frexp(v, &e) * 256.0f / v;
+	for (int c = 0; c < 3; c++)
+		rgbe[c] = (unsigned char)(rgb[c] * scale);
+	rgbe[3] = (unsigned char)(e + 128);
+}
+
+// One component of a scanline in the run-length encoding of newer
+// Radiance files: runs of at least MIN_RUN equal bytes are written as a
+// count above 128 and the byte, everything else as a count and literal
+// bytes.
+void writeComponent(FILE* fp, const unsigned char* data, int n)
+{
+	const int MIN_RUN = 4;
+	int cur = 0;
+	while (cur < n) {
+		// Find the next run long enough to be worth encoding, noting the
+		// one just before it.
+		int begRun = cur, runCount = 0, oldRunCount = 0;
+		while (runCount < MIN_RUN && begRun < n) {
+			begRun += runCount;
+			oldRunCount = runCount;
+			runCount = 1;
+			while (begRun + runCount < n && runCount < 127 &&
+			       data[begRun] == data[begRun + runCount])
+				runCount++;
+		}
+		// If everything before it is one short run, write that as a run.
+		if (oldRunCount > 1 && oldRunCount == begRun - cur) {
+			unsigned char run[2] = {(unsigned char)(128 + oldRunCount),
+			                        data[cur]};
+			fwrite(run, 1, 2, fp);
+			cur = begRun;
+		}
+		// Literal bytes up to the run, at most 128 at a time.
+		while (cur < begRun) {
+			int count = std::min(begRun - cur, 128);
+			unsigned char c = (unsigned char)count;
+			fwrite(&c, 1, 1, fp);
+			fwrite(data + cur, 1, count, fp);
+			cur += count;
+		}
+		if (runCount >= MIN_RUN) {
+			unsigned char run[2] = {(unsigned char)(128 + runCount),
+			                        data[begRun]};
+			fwrite(run, 1, 2, fp);
+			cur += runCount;
+		}
+	}
+}
+}
+
+// Rows are written top to bottom, the order the "-Y" header promises;
+// the framebuffer's first row is the bottom one.  Widths the encoding
+// cannot describe are written flat.
+void writeHDRFloat(const char *fname, int width, int height,
+                   const FloatRows& rows)
+{
+	FILE *fp = fopen(fname, "wb");
+	if (!fp)
+		throw string("[writeHDR] File could not be opened for writing: ") + fname;
+
+	fprintf(fp, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n",
+	        height, width);
+
+	bool rle = width >= 8 && width < 32768;
+	std::vector<float> rgb(width * 3);
+	std::vector<unsigned char> rgbe(width * 4);
+	std::vector<unsigned char> component(width);
+	for (int j = height - 1; j >= 0; j--) {
+		rows(j, rgb.data());
+		for (int i = 0; i < width; i++)
+			toRGBE(&rgb[i * 3], &rgbe[i * 4]);
+		if (!rle) {
+			fwrite(rgbe.data(), 1, rgbe.size(), fp);
+			continue;
+		}
+		unsigned char start[4] = {2, 2, (unsigned char)(width >> 8),
+		                          (unsigned char)(width & 0xff)};
+		fwrite(start, 1, 4, fp);
+		for (int c = 0; c < 4; c++) {
+			for (int i = 0; i < width; i++)
+				component[i] = rgbe[i * 4 + c];
+			writeComponent(fp, component.data(), width);
+		}
+	}
+	bool failed = ferror(fp) != 0;
+	if (fclose(fp) != 0 || failed)
+		throw string("[writeHDR] Error writing ") + fname;
+}
+
+// For 8-bit images, such as those the GUI holds.
+void writeHDR(const char *fname, int width, int height, const void *data)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	writeHDRFloat(fname, width, height, [&](int j, float* rgb) {
+		const unsigned char* row = bytes + j * width * 3;
+		for (int k = 0; k < width * 3; k++)
+			rgb[k] = row[k] / 255.0f;
+	});
+}
@@ -0,0 +1,12 @@
+#ifndef FILEIO_HDRIMAGE_H
+#define FILEIO_HDRIMAGE_H
+
+#include "images.h"
+
+// Radiance RGBE (.hdr) output, which keeps values above 1 and the full
+// precision of the renderer's float framebuffer.
+void writeHDR(const char *iname, int width, int height, const void* data);
+void writeHDRFloat(const char *iname, int width, int height,
+                   const FloatRows& rows);
+
+#endif
@@ -1,6 +1,7 @@
 #include "images.h"
 #include "bitmap.h"
 #include "pngimage.h"
+#include "hdrimage.h"
 #include <strings.h>
 #include <string>
 #include <iostream>
@@ -22,11 +23,18 @@ struct Backend {
 	const char* ext;
 	std::vector<uint8_t> (*reader)(const char *fname, int& width, int& height);
 	void (*writer)(const char *iname, int width, int height, const void *data);
+	// Only for formats that keep float values.
+	void (*floatWriter)(const char *iname, int width, int height,
+	                    const FloatRows& rows);
+	// Instead of writer, for formats that take ImageOptions.
+	void (*optionsWriter)(const char *iname, int width, int height,
+	                      const void *data, const ImageOptions& options);
 };
 
 Backend backends[] = {
-	{".bmp", readBMP, writeBMP},
-	{".png", readPNG, writePNG},
+	{".bmp", readBMP, writeBMP, nullptr, nullptr},
+	{".png", readPNG, nullptr, nullptr, writePNG},
+	{".hdr", nullptr, writeHDR, writeHDRFloat, nullptr},
 };
 
 const Backend* bmp_handler = &backends[0];
@@ -51,12 +59,13 @@ const Backend* find_handler(const char* fname)
 std::vector<uint8_t> readImage(const char *fname, int& width, int& height)
 {
 	auto handler = find_handler(fname);
-	if (!handler)
+	if (!handler || !handler->reader)
 		return std::vector<uint8_t>();
 	return handler->reader(fname, width, height);
 }
 
-void writeImage(const char *fname, int width, int height, const void* data)
+void writeImage(const char *fname, int width, int height, const void* data,
+                const ImageOptions& options)
 {
 	auto handler = find_handler(fname);
 	if (!handler) {
@@ -64,5 +73,26 @@ void writeImage(const char *fname, int width, int height, const void* data)
 			<< ", writing bmp format" << std::endl;
 		handler = bmp_handler;
 	}
-	handler->writer(fname, width, height, data);
+	if (handler->optionsWriter)
+		handler->optionsWriter(fname, width, height, data, options);
+	else
+		handler->writer(fname, width, height, data);
+}
+
+bool isFloatImage(const char *fname)
+{
+	auto handler = find_handler(fname);
+	return handler && handler->floatWriter;
+}
+
+void writeFloatImage(const char *fname, int width, int height,
+                     const FloatRows& rows)
+{
+	auto handler = find_handler(fname);
+	if (!handler || !handler->floatWriter) {
+		std::cerr << "File " << fname << " cannot hold float values"
+			<< std::endl;
+		return;
+	}
+	handler->floatWriter(fname, width, height, rows);
 }
@@ -1,16 +1,40 @@
 #ifndef FILEIO_IMAGES_H
 #define FILEIO_IMAGES_H
 
+#include <functional>
 #include <vector>
 #include <stdint.h>
 
 /*
  * Improved readBMP/writeBMP.
  * Automatically detects extensions and read/write the data.
- * Currently supports: bmp, png
+ * Currently supports: bmp, png, and hdr for writing only
  * 
  */
 extern std::vector<uint8_t> readImage(const char *fname, int& width, int& height);
-extern void writeImage(const char *iname, int width, int height, const void *data); 
+
+/*
+ * How to write formats that compress: a zlib level from 0 (fastest,
+ * stored) to 9 (smallest), or -1 for zlib's default, and how many
+ * threads may share the work.  Other formats ignore it.
+ */
+struct ImageOptions {
+	int compression = -1;
+	int threads = 1;
+};
+extern void writeImage(const char *iname, int width, int height, const void *data,
+                       const ImageOptions& options = ImageOptions());
+
+/*
+ * Images kept in float, for formats that can hold them.  rows(j, rgb)
+ * fills rgb with the 3 * width floats of row j, counting from the bottom
+ * like the 8-bit data; writers ask for each row once, in whatever order
+ * they store them, so nothing is copied ahead of time.
+ */
+typedef std::function<void(int j, float* rgb)> FloatRows;
+// Whether fname names a format that keeps float values.
+extern bool isFloatImage(const char *fname);
+extern void writeFloatImage(const char *iname, int width, int height,
+                            const FloatRows& rows);
 
 #endif
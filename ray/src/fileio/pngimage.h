@@ -4,9 +4,14 @@
 #include <vector>
 #include <stdint.h>
 
+#include "images.h"
+
 void png_version_info(void);
 
 std::vector<uint8_t> readPNG(const char *fname, int& width, int& height);
-void writePNG(const char *iname, int width, int height, const void* data); 
+// Bands of rows are filtered and deflated on up to options.threads
+// threads; the file is the same whatever the number of threads.
+void writePNG(const char *iname, int width, int height, const void* data,
+              const ImageOptions& options = ImageOptions());
 
 #endif
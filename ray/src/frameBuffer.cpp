@@ -0,0 +1,114 @@
+#include "frameBuffer.h"
+
+#include <string.h>
+#include <algorithm>
+
+// As for the triangle packs, the SIMD kernel is compiled for its own
+// instruction set and only called after checking the CPU for it.
+#if (defined(__GNUC__) || defined(__clang__)) && \
+        (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FRAME_X86 1
+#endif
+
+namespace {
+typedef void (*QuantizeKernel)(const float* in, unsigned char* out,
+                               int count);
+
+// The one definition of a pixel's bytes; the SIMD kernel follows it
+// operation for operation.  A NaN, like a pixel without samples, comes
+// out black.
+inline unsigned char quantizeChannel(float sum, float samples)
+{
+	float q = sum * 255.0f / samples;
+	return (unsigned char)(int)(q > 0.0f ? std::min(q, 255.0f) : 0.0f);
+}
+
+void quantizeScalar(const float* in, unsigned char* out, int count)
+{
+	for (int k = 0; k < count; k++, in += 4, out += 3)
+		for (int c = 0; c < 3; c++)
+			out[c] = in[3] > 0.0f ? quantizeChannel(in[c], in[3]) : 0;
+}
+
+#ifdef FRAME_X86
+// Four pixels a step: each is one vector of (r, g, b, count), scaled by
+// 255 over its broadcast count, clamped, truncated to integers and packed
+// down to bytes, of which the twelve colour bytes are gathered at the
+// front and stored.
+__attribute__((target("ssse3"))) void quantizeSsse3(const float* in,
+                                                    unsigned char* out,
+                                                    int count)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 scale = _mm_set1_ps(255.0f);
+	const __m128i gather = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12,
+	                                     13, 14, -1, -1, -1, -1);
+	int k = 0;
+	for (; k + 4 <= count; k += 4, in += 16, out += 12) {
+		__m128i q[4];
+		for (int p = 0; p < 4; p++) {
+			__m128 v = _mm_loadu_ps(in + 4 * p);
+			__m128 n = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+			__m128 s = _mm_div_ps(_mm_mul_ps(v, scale), n);
+			// Without samples the pixel is black, whatever its sum.
+			s = _mm_and_ps(s, _mm_cmpgt_ps(n, zero));
+			s = _mm_min_ps(_mm_max_ps(s, zero), scale);
+			q[p] = _mm_cvttps_epi32(s);
+		}
+		__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]),
+		                                 _mm_packs_epi32(q[2], q[3]));
+		__m128i rgb = _mm_shuffle_epi8(bytes, gather);
+		_mm_storel_epi64((__m128i*)out, rgb);
+		int last = _mm_cvtsi128_si32(_mm_srli_si128(rgb, 8));
+		memcpy(out + 8, &last, 4);
+	}
+	quantizeScalar(in, out, count - k);
+}
+#endif
+
+QuantizeKernel chooseKernel()
+{
+#ifdef FRAME_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+		return quantizeSsse3;
+#endif
+	return quantizeScalar;
+}
+
+const QuantizeKernel kernel = chooseKernel();
+}
+
+void FrameBuffer::resize(int w, int h)
+{
+	width = w;
+	height = h;
+	pixels.assign((size_t)w * h * 4, 0.0f);
+	// Made by the first quantize(), so that an image only written as
+	// floats never has one.
+	bytes.clear();
+	bytes.shrink_to_fit();
+}
+
+void FrameBuffer::clear()
+{
+	std::fill(pixels.begin(), pixels.end(), 0.0f);
+}
+
+void FrameBuffer::getRow(int j, float* rgb) const
+{
+	const float* p = &pixels[(size_t)j * width * 4];
+	for (int i = 0; i < width; i++, p += 4, rgb += 3)
+		for (int c = 0; c < 3; c++)
+			rgb[c] = p[3] > 0.0f ? p[c] / p[3] : 0.0f;
+}
+
+unsigned char* FrameBuffer::quantize()
+{
+	if (pixels.empty())
+		return nullptr;
+	bytes.resize((size_t)width * height * 3);
+	kernel(pixels.data(), bytes.data(), width * height);
+	return bytes.data();
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+// The image being rendered.  Each pixel is kept in single precision as
+// the sum of the samples that went into it and how many there were, so
+// that passes which refine a pixel can read back what earlier ones
+// computed without losing anything to rounding.  Samples may be above 1
+// when the image is to be written as floats; 8-bit values are clamped
+// and made only when they are needed, for display or for writing a file.
+//
+// Quantization converts the whole image at once: SSSE3 does four pixels
+// per step where the CPU has it, and a scalar loop is used everywhere
+// else, giving the same bytes.
+class FrameBuffer {
+public:
+	// Resize to w x h and clear.
+	void resize(int w, int h);
+	// Make every pixel black, with no samples.
+	void clear();
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	bool empty() const { return pixels.empty(); }
+
+	// Make (i, j) the mean of samples samples, whose mean is color.
+	void set(int i, int j, const glm::dvec3& color, int samples = 1)
+	{
+		float* p = &pixels[(i + j * width) * 4];
+		p[0] = (float)(color[0] * samples);
+		p[1] = (float)(color[1] * samples);
+		p[2] = (float)(color[2] * samples);
+		p[3] = (float)samples;
+	}
+	// The mean of the samples at (i, j); black if there are none.
+	glm::dvec3 get(int i, int j) const
+	{
+		const float* p = &pixels[(i + j * width) * 4];
+		if (!(p[3] > 0.0f))
+			return glm::dvec3(0.0, 0.0, 0.0);
+		return glm::dvec3(p[0], p[1], p[2]) / (double)p[3];
+	}
+	int getSamples(int i, int j) const
+	{
+		return (int)pixels[(i + j * width) * 4 + 3];
+	}
+	// The means of row j, unclamped, as 3 * width floats.
+	void getRow(int j, float* rgb) const;
+
+	// The image as rows of 8-bit RGB, each channel clamped to [0, 1] and
+	// scaled by 255, rounding down.  The pointer stays valid until the
+	// next resize().
+	unsigned char* quantize();
+
+private:
+	int width = 0;
+	int height = 0;
+	std::vector<float> pixels;       // red, green, blue sums and count
+	std::vector<unsigned char> bytes; // from the last quantize(), if any
+};
@@ -616,7 +616,6 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         }
         _tokenizer.Read( RPAREN );
         _tokenizer.Read( SEMICOLON );
-        tmesh->vertNorms = true;
         break;
 
       case FACES:
@@ -684,6 +683,23 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         if ((error = tmesh->doubleCheck()))
           throw ParserException(error);
 
+        // Instance an identical mesh parsed earlier instead of keeping a
+        // second copy of its geometry and BVH, which is built once the
+        // whole scene has been read.
+        {
+          size_t hash = tmesh->geometryHash();
+          Trimesh* twin = 0;
+          auto range = meshes.equal_range( hash );
+          for( auto it = range.first; it != range.second && !twin; ++it )
+            if( tmesh->canShareWith( *it->second ) )
+              twin = it->second;
+
+          if( twin )
+            tmesh->shareMesh( *twin );
+          else
+            meshes.emplace( hash, tmesh );
+        }
+
         scene->add( tmesh );
         return;
       }
@@ -105,6 +105,7 @@ private:
   private:
     Tokenizer& _tokenizer;
     mmap materials;
+    std::multimap<size_t, Trimesh*> meshes; // by Trimesh::geometryHash()
     std::string _basePath;
 };
 
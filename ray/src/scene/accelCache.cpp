@@ -0,0 +1,202 @@
+#include "accelCache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// File layout: a Header, count EntryRecords, then the blobs, each
+// starting on a BLOB_ALIGN boundary so they can be used in place.
+namespace {
+const char MAGIC[8] = {'R', 'A', 'Y', 'A', 'C', 'C', 'L', '1'};
+const uint64_t BLOB_ALIGN = 64;
+
+struct Header {
+	char magic[8];
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct EntryRecord {
+	uint64_t key;
+	uint64_t offset;
+	uint64_t size;
+};
+
+uint64_t alignUp(uint64_t n)
+{
+	return (n + BLOB_ALIGN - 1) / BLOB_ALIGN * BLOB_ALIGN;
+}
+}
+
+struct AccelCache::MappedFile {
+	const char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	std::vector<char> contents;
+#endif
+
+	explicit MappedFile(const std::string& path)
+	{
+#ifndef _WIN32
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE,
+			               fd, 0);
+			if (p != MAP_FAILED) {
+				data = static_cast<const char*>(p);
+				size = st.st_size;
+			}
+		}
+		close(fd);
+#else
+		// No mmap here; read the whole file instead.
+		std::ifstream in(path, std::ios::binary);
+		if (!in)
+			return;
+		contents.assign(std::istreambuf_iterator<char>(in),
+		                std::istreambuf_iterator<char>());
+		data = contents.data();
+		size = contents.size();
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifndef _WIN32
+		if (data)
+			munmap(const_cast<char*>(data), size);
+#endif
+	}
+};
+
+AccelCache::AccelCache(const std::string& path) : path(path)
+{
+	auto mapped = std::make_shared<MappedFile>(path);
+	if (mapped->size < sizeof(Header))
+		return;
+
+	Header header;
+	memcpy(&header, mapped->data, sizeof(header));
+	if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0)
+		return;
+	uint64_t tableEnd =
+	        sizeof(Header) + (uint64_t)header.count * sizeof(EntryRecord);
+	if (tableEnd > mapped->size)
+		return;
+
+	const char* table = mapped->data + sizeof(Header);
+	for (uint32_t k = 0; k < header.count; k++) {
+		EntryRecord rec;
+		memcpy(&rec, table + k * sizeof(EntryRecord), sizeof(rec));
+		if (rec.offset % BLOB_ALIGN != 0 || rec.offset < tableEnd ||
+		    rec.size > mapped->size - rec.offset) {
+			// A damaged file is thrown away and rebuilt.
+			entries.clear();
+			return;
+		}
+		entries[rec.key] = Entry{rec.offset, rec.size};
+	}
+	file = mapped;
+}
+
+AccelCache::~AccelCache() {}
+
+bool AccelCache::find(uint64_t key, const char*& data, size_t& size)
+{
+	auto it = entries.find(key);
+	if (it == entries.end())
+		return false;
+	used.insert(key);
+	data = file->data + it->second.offset;
+	size = it->second.size;
+	return true;
+}
+
+void AccelCache::store(uint64_t key, std::string blob)
+{
+	used.erase(key);
+	pending[key] = std::move(blob);
+}
+
+void AccelCache::save()
+{
+	if (pending.empty() && used.size() == entries.size())
+		return;
+
+	struct Source {
+		uint64_t key;
+		const char* data;
+		uint64_t size;
+	};
+	std::vector<Source> sources;
+	for (uint64_t key : used) {
+		const Entry& e = entries[key];
+		sources.push_back(Source{key, file->data + e.offset, e.size});
+	}
+	for (const auto& p : pending)
+		sources.push_back(Source{p.first, p.second.data(),
+		                         (uint64_t)p.second.size()});
+
+	Header header;
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.count = (uint32_t)sources.size();
+	header.reserved = 0;
+	std::vector<EntryRecord> table;
+	uint64_t offset =
+	        alignUp(sizeof(Header) + sources.size() * sizeof(EntryRecord));
+	for (const Source& s : sources) {
+		table.push_back(EntryRecord{s.key, offset, s.size});
+		offset = alignUp(offset + s.size);
+	}
+
+	// Write a new file and move it into place, so that a concurrent
+	// reader (or our own mapping of the old file) never sees it half
+	// written.  The name is unique to this process and call, so that two
+	// renders saving the same cache each write a file of their own.
+	static std::atomic<unsigned> saves(0);
+	std::string tmp = path + "." + std::to_string(getpid()) + "." +
+	                  std::to_string(saves++) + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(table.data()),
+		          table.size() * sizeof(EntryRecord));
+		uint64_t written =
+		        sizeof(Header) + table.size() * sizeof(EntryRecord);
+		static const char zeros[BLOB_ALIGN] = {};
+		for (size_t k = 0; k < sources.size(); k++) {
+			out.write(zeros, table[k].offset - written);
+			out.write(sources[k].data, sources[k].size);
+			written = table[k].offset + sources[k].size;
+		}
+		if (!out) {
+			out.close();
+			remove(tmp.c_str());
+			return;
+		}
+	}
+#ifdef _WIN32
+	// rename() will not replace an existing file here.
+	remove(path.c_str());
+#endif
+	if (rename(tmp.c_str(), path.c_str()) != 0)
+		remove(tmp.c_str());
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+// A file of prebuilt acceleration structures, kept next to a scene and
+// keyed by a hash of the geometry each one was built over.
+//
+// The previous run's file is mapped read-only, and find() hands out
+// pointers straight into the mapping, so a structure can be used without
+// copying it; mapping() keeps the file mapped for as long as anything
+// refers to it.  Structures built this run are added with store(), and
+// save() rewrites the file with exactly the entries that were looked up
+// or stored, so geometry that has left the scene is dropped from it.
+class AccelCache {
+public:
+	explicit AccelCache(const std::string& path);
+	~AccelCache();
+
+	// The blob stored under key, if the file has one.
+	bool find(uint64_t key, const char*& data, size_t& size);
+	std::shared_ptr<const void> mapping() const { return file; }
+
+	// Replace whatever is stored under key.
+	void store(uint64_t key, std::string blob);
+
+	// Rewrite the file if its contents changed.  Failing to write (a
+	// read-only scene directory, say) just leaves the cache unused.
+	void save();
+
+private:
+	struct Entry {
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	struct MappedFile;
+
+	std::string path;
+	std::shared_ptr<const MappedFile> file;
+	std::map<uint64_t, Entry> entries;
+	std::map<uint64_t, std::string> pending;
+	std::set<uint64_t> used;
+};
@@ -0,0 +1,1093 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bbox.h"
+#include "ray.h"
+#include "rayPacket.h"
+
+// A bounding volume hierarchy over the primitives of a Prims set, which
+// numbers them 0 to primitiveCount() - 1 and provides
+// primitiveBounds(k, bmin, bmax) for each.  Traversal hands each leaf it
+// reaches to intersectLeaf(first, ids, count, ray&, tMax, isect&), which
+// tests primitives ids[0] to ids[count - 1] (the leaf's entries, starting
+// at entry first of the hierarchy) and sets isect to the nearest hit
+// closer than tMax, returning whether there was one.  Primitives are only
+// ever referred to by number, so the set is free to store them as
+// compactly as it likes, and forEachLeaf() lets it lay out data per leaf.
+// Unlike KdTree, every primitive is referenced by exactly one leaf, which
+// makes it the better fit for the many small, tightly packed faces of a
+// mesh.
+//
+// Splits are chosen with a binned surface area heuristic, and large
+// subtrees are built on separate threads.  Optionally the build also
+// considers spatial splits (as in an SBVH), which cut primitives that
+// straddle a plane into a reference on each side instead of letting the
+// two children's boxes overlap; this needs Prims to provide
+// clipPrimitive(k, axis, lo, hi, bmin, bmax), the bounds of the part of
+// primitive k within a slab.
+//
+// Nodes are stored depth-first in one flat array: the first child of an
+// interior node immediately follows it, the second is found at
+// Node::offset.
+//
+// The binary tree is also collapsed into a 4-wide tree whose nodes keep
+// their children's boxes side by side in single precision, so that
+// intersectWide() can test all four with one set of SSE slab tests.
+// Coherent rays can instead go down the binary tree together, as a
+// RayPacket, with intersectPacket(), and shadow rays, which need any hit
+// rather than the closest, use anyHit().
+//
+// Both trees can be written out with serialize() and later traversed in
+// place from that memory (a mapped AccelCache file, say) via load().
+// Either way the hierarchy refers to prims, which must outlive it.
+template <typename Prims>
+class Bvh {
+public:
+	// Build over prims using up to threads threads.  Spatial splits may
+	// add up to splitBudget * prims.primitiveCount() extra primitive
+	// references; a budget of 0 turns them off.  If intersectLeaf() tests
+	// up to packWidth primitives at once, for about the cost of PACK_COST
+	// single ones, pass that width so the leaves are sized to match.
+	explicit Bvh(const Prims& prims, int threads = 1,
+	             double splitBudget = 0.0, int packWidth = 1)
+	        : prims(&prims)
+	{
+		int count = prims.primitiveCount();
+		std::vector<BuildPrim> build;
+		build.reserve(count);
+		for (int k = 0; k < count; k++) {
+			glm::dvec3 bmin, bmax;
+			prims.primitiveBounds(k, bmin, bmax);
+			build.push_back(
+			        BuildPrim{bmin, bmax, 0.5 * (bmin + bmax), k});
+		}
+		if (build.empty())
+			return;
+
+		BuildState state;
+		state.spareRefs = (int)(std::max(splitBudget, 0.0) * count);
+		state.packWidth = std::max(packWidth, 1);
+		glm::dvec3 rootMin = build[0].bmin, rootMax = build[0].bmax;
+		for (const BuildPrim& b : build) {
+			rootMin = glm::min(rootMin, b.bmin);
+			rootMax = glm::max(rootMax, b.bmax);
+		}
+		// Only overlap that is significant next to the whole tree is
+		// worth duplicating references for.
+		state.minOverlap = 1.0e-5 * area(rootMin, rootMax);
+
+		Subtree tree;
+		buildNode(prims, build, 0, std::max(threads, 1), state, tree);
+		nodes = std::move(tree.nodes);
+		primIds = std::move(tree.ids);
+
+		glm::dvec3 extent = nodes[0].bmax - nodes[0].bmin;
+		for (int axis = 0; axis < 3; axis++)
+			widePad = std::max({widePad, std::abs(nodes[0].bmin[axis]),
+			                    std::abs(nodes[0].bmax[axis]),
+			                    extent[axis]});
+		// Slack for rounding the ray origin to single precision; safe
+		// while the origin is within ~100x the hierarchy's size.
+		widePad *= 1.0e-5;
+		collapse(0);
+
+		nodeData = nodes.data();
+		numNodes = (int)nodes.size();
+		wideData = wideNodes.data();
+		numWide = (int)wideNodes.size();
+		idData = primIds.data();
+		numIds = (int)primIds.size();
+	}
+
+	Bvh(const Bvh&) = delete;
+	Bvh& operator=(const Bvh&) = delete;
+
+	// The trees in a form load() can use in place.  It is this build's
+	// in-memory layout, so load() rejects it from a different one.
+	std::string serialize() const
+	{
+		BlobHeader h;
+		h.nodeSize = sizeof(Node);
+		h.wideNodeSize = sizeof(WideNode);
+		h.nodeCount = numNodes;
+		h.wideCount = numWide;
+		h.primCount = (uint32_t)numIds;
+		h.reserved = 0;
+
+		std::string blob(reinterpret_cast<const char*>(&h), sizeof(h));
+		blob.append(reinterpret_cast<const char*>(nodeData),
+		            numNodes * sizeof(Node));
+		blob.append(reinterpret_cast<const char*>(wideData),
+		            numWide * sizeof(WideNode));
+		blob.append(reinterpret_cast<const char*>(idData),
+		            numIds * sizeof(int32_t));
+		return blob;
+	}
+
+	// A hierarchy over prims read straight from data, which serialize()
+	// wrote for the same prims; backing keeps data alive for as long as
+	// the hierarchy is.  Returns null if data does not describe a valid
+	// tree over prims.  data must be 8-byte aligned.
+	static Bvh* load(const Prims& prims, const char* data, size_t size,
+	                 std::shared_ptr<const void> backing)
+	{
+		int count = prims.primitiveCount();
+		BlobHeader h;
+		if (size < sizeof(h))
+			return nullptr;
+		memcpy(&h, data, sizeof(h));
+		if (h.nodeSize != sizeof(Node) ||
+		    h.wideNodeSize != sizeof(WideNode) ||
+		    h.primCount < (uint32_t)count ||
+		    (h.nodeCount == 0) != (count == 0))
+			return nullptr;
+
+		size_t wideAt = sizeof(h) + (size_t)h.nodeCount * sizeof(Node);
+		size_t idsAt = wideAt + (size_t)h.wideCount * sizeof(WideNode);
+		if (idsAt + (size_t)h.primCount * sizeof(int32_t) != size ||
+		    reinterpret_cast<uintptr_t>(data) % alignof(Node) != 0)
+			return nullptr;
+
+		std::unique_ptr<Bvh> bvh(new Bvh(&prims));
+		bvh->nodeData = reinterpret_cast<const Node*>(data + sizeof(h));
+		bvh->numNodes = (int)h.nodeCount;
+		bvh->wideData = reinterpret_cast<const WideNode*>(data + wideAt);
+		bvh->numWide = (int)h.wideCount;
+		bvh->idData = reinterpret_cast<const int32_t*>(data + idsAt);
+		bvh->numIds = (int)h.primCount;
+		for (int k = 0; k < bvh->numIds; k++)
+			if (bvh->idData[k] < 0 || bvh->idData[k] >= count)
+				return nullptr;
+		if (!bvh->indicesValid() || !bvh->shapeValid())
+			return nullptr;
+		bvh->backing = std::move(backing);
+		return bvh.release();
+	}
+
+	// Closest hit along r, in the same space as the primitives' bounding
+	// boxes.  Returns false and leaves i untouched on a miss.
+	bool intersect(ray& r, isect& i) const
+	{
+		if (numNodes == 0)
+			return false;
+
+		glm::dvec3 p = r.getPosition();
+		glm::dvec3 d = r.getDirection();
+		glm::dvec3 invDir(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+		bool dirIsNeg[3] = {invDir[0] < 0, invDir[1] < 0, invDir[2] < 0};
+
+		int todo[MAX_STACK];
+		int todoSize = 0;
+		int cur = 0;
+		bool have_one = false;
+		for (;;) {
+			const Node& node = nodeData[cur];
+			double tFar = have_one ? i.getT() : 1.0e308;
+			if (hitBox(node, p, invDir, tFar)) {
+				if (node.count > 0) {
+					if (prims->intersectLeaf(node.offset,
+					                         idData + node.offset,
+					                         node.count, r, tFar, i))
+						have_one = true;
+				} else if (dirIsNeg[node.axis]) {
+					// Visit the child nearer the ray origin first.
+					todo[todoSize++] = cur + 1;
+					cur = node.offset;
+					continue;
+				} else {
+					todo[todoSize++] = node.offset;
+					cur = cur + 1;
+					continue;
+				}
+			}
+			if (todoSize == 0)
+				break;
+			cur = todo[--todoSize];
+		}
+		return have_one;
+	}
+
+	// Same result as intersect(), traversing the 4-wide tree instead.
+	bool intersectWide(ray& r, isect& i) const
+	{
+		if (numWide == 0)
+			return false;
+
+		// A zero direction component would give 0 * inf = NaN in the slab
+		// test; a tiny stand-in keeps every t finite or infinite.
+		glm::dvec3 p = r.getPosition();
+		glm::dvec3 d = r.getDirection();
+		float org[3], invDir[3];
+		for (int axis = 0; axis < 3; axis++) {
+			double da = d[axis];
+			if (std::abs(da) < 1.0e-30)
+				da = da < 0 ? -1.0e-30 : 1.0e-30;
+			org[axis] = (float)p[axis];
+			invDir[axis] = (float)(1.0 / da);
+		}
+
+		struct Todo {
+			int index;
+			int count;
+			float tNear;
+		};
+		Todo todo[3 * MAX_STACK + 4];
+		int todoSize = 0;
+		todo[todoSize++] = Todo{0, 0, 0.0f};
+
+		bool have_one = false;
+		while (todoSize > 0) {
+			Todo cur = todo[--todoSize];
+			if (have_one && cur.tNear > farLimit(i.getT()))
+				continue;
+
+			if (cur.count > 0) {
+				double tMax = have_one ? i.getT()
+				                       : std::numeric_limits<double>::infinity();
+				if (prims->intersectLeaf(cur.index, idData + cur.index,
+				                         cur.count, r, tMax, i))
+					have_one = true;
+				continue;
+			}
+
+			const WideNode& node = wideData[cur.index];
+			float tFar = have_one ? farLimit(i.getT())
+			                      : std::numeric_limits<float>::infinity();
+			float tNear[4];
+			int mask = hitBoxes(node, org, invDir, tFar, tNear) &
+			           node.valid;
+			if (!mask)
+				continue;
+
+			// Push the hit children farthest first so the nearest is
+			// popped next.
+			int order[4], n = 0;
+			for (int k = 0; k < 4; k++)
+				if (mask & (1 << k))
+					order[n++] = k;
+			for (int k = 1; k < n; k++)
+				for (int j = k; j > 0 && tNear[order[j]] >
+				                                 tNear[order[j - 1]];
+				     j--)
+					std::swap(order[j], order[j - 1]);
+			for (int k = 0; k < n; k++) {
+				int c = order[k];
+				todo[todoSize++] =
+				        Todo{node.child[c], node.count[c], tNear[c]};
+			}
+		}
+		return have_one;
+	}
+
+	// Any-hit traversal of the 4-wide tree: calls visit(first, ids,
+	// count) for each leaf whose box r enters closer than tMax, in no
+	// particular order, until visit returns true.  Returns whether it
+	// did.
+	template <typename F>
+	bool anyHit(ray& r, double tMax, F visit) const
+	{
+		if (numWide == 0)
+			return false;
+
+		glm::dvec3 p = r.getPosition();
+		glm::dvec3 d = r.getDirection();
+		float org[3], invDir[3];
+		for (int axis = 0; axis < 3; axis++) {
+			double da = d[axis];
+			if (std::abs(da) < 1.0e-30)
+				da = da < 0 ? -1.0e-30 : 1.0e-30;
+			org[axis] = (float)p[axis];
+			invDir[axis] = (float)(1.0 / da);
+		}
+		float tFar = farLimit(tMax);
+
+		struct Todo {
+			int index;
+			int count;
+		};
+		Todo todo[3 * MAX_STACK + 4];
+		int todoSize = 0;
+		todo[todoSize++] = Todo{0, 0};
+		while (todoSize > 0) {
+			Todo cur = todo[--todoSize];
+			if (cur.count > 0) {
+				if (visit(cur.index, idData + cur.index, cur.count))
+					return true;
+				continue;
+			}
+			const WideNode& node = wideData[cur.index];
+			float tNear[4];
+			int mask = hitBoxes(node, org, invDir, tFar, tNear) &
+			           node.valid;
+			for (int k = 0; mask; k++, mask >>= 1)
+				if (mask & 1)
+					todo[todoSize++] =
+					        Todo{node.child[k], node.count[k]};
+		}
+		return false;
+	}
+
+	// The closest hit of every ray of packet that is nearer than the hit
+	// it already holds, traversing the binary tree once for the whole
+	// packet.  Each node is tested against the ray that reached its
+	// parent first; only if that misses is the frustum, and then each
+	// later ray, tried.  Returns a mask (bit k for ray k) of the rays
+	// whose hit changed.
+	uint64_t intersectPacket(RayPacket& packet) const
+	{
+		if (numNodes == 0)
+			return 0;
+
+		const Frustum& frustum = packet.getFrustum();
+		const glm::dvec3& p = frustum.getOrigin();
+		const glm::dvec3& center = frustum.getCenter();
+		int n = packet.size();
+
+		struct Todo {
+			int node;
+			int first; // first ray that may hit it
+		};
+		Todo todo[MAX_STACK];
+		int todoSize = 0;
+		int cur = 0, first = 0;
+		uint64_t changed = 0;
+		for (;;) {
+			const Node& node = nodeData[cur];
+			int k = firstHit(node, packet, first);
+			if (k < n) {
+				if (node.count > 0) {
+					for (; k < n; k++) {
+						double tMax = packet.maxT(k);
+						if (!hitBox(node, p,
+						            packet.getInverseDirection(k),
+						            tMax))
+							continue;
+						if (prims->intersectLeaf(
+						            node.offset, idData + node.offset,
+						            node.count, packet.getRay(k), tMax,
+						            packet.getIsect(k))) {
+							packet.setHit(k);
+							changed |= uint64_t(1) << k;
+						}
+					}
+				} else if (center[node.axis] < 0) {
+					todo[todoSize++] = Todo{cur + 1, k};
+					cur = node.offset;
+					first = k;
+					continue;
+				} else {
+					todo[todoSize++] = Todo{node.offset, k};
+					cur = cur + 1;
+					first = k;
+					continue;
+				}
+			}
+			if (todoSize == 0)
+				break;
+			--todoSize;
+			cur = todo[todoSize].node;
+			first = todo[todoSize].first;
+		}
+		return changed;
+	}
+
+	int nodeCount() const { return numNodes; }
+	int wideNodeCount() const { return numWide; }
+	int entryCount() const { return numIds; }
+
+	// Call f(first, ids, count) for every leaf, where ids are its count
+	// primitives, which start at entry first.  Both trees share leaves.
+	template <typename F>
+	void forEachLeaf(F f) const
+	{
+		for (int k = 0; k < numNodes; k++) {
+			const Node& n = nodeData[k];
+			if (n.count > 0)
+				f(n.offset, idData + n.offset, n.count);
+		}
+	}
+
+private:
+	// Relative costs used by the SAH, and the largest leaf the build will
+	// accept when a split is not worth it.
+	static constexpr double TRAVERSAL_COST = 1.0;
+	static constexpr double INTERSECT_COST = 1.0;
+	static constexpr int MAX_LEAF_SIZE = 8;
+	static constexpr double PACK_COST = 2.0;
+	static constexpr int BIN_COUNT = 16;
+	// Ranges smaller than this are not worth handing to another thread.
+	static constexpr int PARALLEL_MIN = 4096;
+	static constexpr int MAX_STACK = 64;
+
+	struct Node {
+		glm::dvec3 bmin;
+		glm::dvec3 bmax;
+		int offset; // leaf: first entry in ids; interior: second child
+		int count;  // number of primitives, 0 for interior nodes
+		int axis;   // interior: axis the children were split along
+	};
+
+	// Four child boxes in SoA layout.  Slot k is a leaf when count[k] > 0
+	// (child[k] is then its first entry in ids) and an interior node
+	// otherwise (child[k] indexes wideNodes).  Bit k of valid is clear
+	// for unused slots.
+	struct WideNode {
+		float bmin[3][4];
+		float bmax[3][4];
+		int child[4];
+		int count[4];
+		int valid;
+	};
+
+	struct BlobHeader {
+		uint32_t nodeSize;
+		uint32_t wideNodeSize;
+		uint32_t nodeCount;
+		uint32_t wideCount;
+		uint32_t primCount;
+		uint32_t reserved;
+	};
+
+	struct BuildPrim {
+		glm::dvec3 bmin;
+		glm::dvec3 bmax;
+		glm::dvec3 centroid;
+		int index;
+	};
+
+	explicit Bvh(const Prims* prims) : prims(prims) {}
+
+	// Whether every child and primitive reference of a loaded tree is
+	// in range.
+	bool indicesValid() const
+	{
+		int numPrims = numIds;
+		for (int k = 0; k < numNodes; k++) {
+			const Node& n = nodeData[k];
+			if (n.count > 0 ? n.offset < 0 || n.offset > numPrims - n.count
+			                : n.offset <= k || n.offset >= numNodes ||
+			                          k + 1 >= numNodes || n.count < 0 ||
+			                          n.axis < 0 || n.axis > 2)
+				return false;
+		}
+		for (int k = 0; k < numWide; k++) {
+			const WideNode& w = wideData[k];
+			for (int c = 0; c < 4; c++) {
+				if (!(w.valid & (1 << c)))
+					continue;
+				if (w.count[c] > 0 ? w.child[c] < 0 ||
+				                             w.child[c] > numPrims - w.count[c]
+				                   : w.child[c] <= k || w.child[c] >= numWide ||
+				                             w.count[c] < 0)
+					return false;
+			}
+		}
+		return true;
+	}
+
+	// Whether both loaded trees, walked from their roots, reach each
+	// node once and are no deeper than the build makes them: an interior
+	// node at depth MAX_STACK - 1 or more would overflow the traversal
+	// stacks.  Together with indicesValid(), a damaged file cannot send
+	// traversal astray.
+	bool shapeValid() const
+	{
+		struct Visit {
+			int node, depth;
+		};
+		std::vector<Visit> todo;
+		std::vector<char> seen(numNodes, 0);
+		if (numNodes > 0)
+			todo.push_back(Visit{0, 0});
+		while (!todo.empty()) {
+			Visit v = todo.back();
+			todo.pop_back();
+			if (seen[v.node]++)
+				return false;
+			const Node& n = nodeData[v.node];
+			if (n.count > 0)
+				continue;
+			if (v.depth >= MAX_STACK - 1)
+				return false;
+			todo.push_back(Visit{v.node + 1, v.depth + 1});
+			todo.push_back(Visit{n.offset, v.depth + 1});
+		}
+		seen.assign(numWide, 0);
+		if (numWide > 0)
+			todo.push_back(Visit{0, 0});
+		while (!todo.empty()) {
+			Visit v = todo.back();
+			todo.pop_back();
+			if (seen[v.node]++ || v.depth >= MAX_STACK - 1)
+				return false;
+			const WideNode& w = wideData[v.node];
+			for (int c = 0; c < 4; c++)
+				if ((w.valid & (1 << c)) && w.count[c] == 0)
+					todo.push_back(Visit{w.child[c], v.depth + 1});
+		}
+		return true;
+	}
+
+	static double area(const glm::dvec3& bmin, const glm::dvec3& bmax)
+	{
+		glm::dvec3 e = bmax - bmin;
+		return 2.0 * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+	}
+
+	static bool hitBox(const Node& node, const glm::dvec3& p,
+	                   const glm::dvec3& invDir, double tFar)
+	{
+		double tMin = 0.0, tMax = tFar;
+		for (int axis = 0; axis < 3; axis++) {
+			double t1 = (node.bmin[axis] - p[axis]) * invDir[axis];
+			double t2 = (node.bmax[axis] - p[axis]) * invDir[axis];
+			if (t1 > t2)
+				std::swap(t1, t2);
+			// NaN (origin on a slab of a parallel ray) never culls.
+			if (t1 > tMin)
+				tMin = t1;
+			if (t2 < tMax)
+				tMax = t2;
+			if (tMin > tMax)
+				return false;
+		}
+		return true;
+	}
+
+	// The first ray of packet, from first on, that hits node, or
+	// packet.size() if none does.
+	static int firstHit(const Node& node, RayPacket& packet, int first)
+	{
+		int n = packet.size();
+		const glm::dvec3& p = packet.getFrustum().getOrigin();
+		if (hitBox(node, p, packet.getInverseDirection(first),
+		           packet.maxT(first)))
+			return first;
+		if (!packet.getFrustum().mayHit(node.bmin, node.bmax))
+			return n;
+		for (int k = first + 1; k < n; k++)
+			if (hitBox(node, p, packet.getInverseDirection(k),
+			           packet.maxT(k)))
+				return k;
+		return n;
+	}
+
+	// Allow for the single precision of the wide tree when comparing
+	// against a hit distance computed in double.
+	static float farLimit(double t) { return (float)t * (1.0f + 1.0e-5f); }
+
+	static int hitBoxes(const WideNode& node, const float org[3],
+	                    const float invDir[3], float tFar, float tNear[4])
+	{
+#ifdef __SSE2__
+		__m128 tmin = _mm_setzero_ps();
+		__m128 tmax = _mm_set1_ps(tFar);
+		for (int axis = 0; axis < 3; axis++) {
+			__m128 o = _mm_set1_ps(org[axis]);
+			__m128 inv = _mm_set1_ps(invDir[axis]);
+			__m128 t1 = _mm_mul_ps(
+			        _mm_sub_ps(_mm_loadu_ps(node.bmin[axis]), o), inv);
+			__m128 t2 = _mm_mul_ps(
+			        _mm_sub_ps(_mm_loadu_ps(node.bmax[axis]), o), inv);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+		}
+		_mm_storeu_ps(tNear, tmin);
+		return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+		int mask = 0;
+		for (int k = 0; k < 4; k++) {
+			float tmin = 0.0f, tmax = tFar;
+			for (int axis = 0; axis < 3; axis++) {
+				float t1 = (node.bmin[axis][k] - org[axis]) *
+				           invDir[axis];
+				float t2 = (node.bmax[axis][k] - org[axis]) *
+				           invDir[axis];
+				tmin = std::max(tmin, std::min(t1, t2));
+				tmax = std::min(tmax, std::max(t1, t2));
+			}
+			tNear[k] = tmin;
+			if (tmin <= tmax)
+				mask |= 1 << k;
+		}
+		return mask;
+#endif
+	}
+
+	// Collapse the binary subtree rooted at nodes[index] into wideNodes,
+	// returning the index of its wide root.  Each wide node takes the
+	// four largest descendants reachable by repeatedly opening the
+	// interior child with the biggest surface area.
+	int collapse(int index)
+	{
+		int self = (int)wideNodes.size();
+		wideNodes.push_back(WideNode());
+
+		int slots[4], n = 0;
+		if (nodes[index].count > 0) {
+			slots[n++] = index;
+		} else {
+			slots[n++] = index + 1;
+			slots[n++] = nodes[index].offset;
+		}
+		while (n < 4) {
+			int best = -1;
+			double bestArea = -1.0;
+			for (int k = 0; k < n; k++) {
+				const Node& c = nodes[slots[k]];
+				double a = area(c.bmin, c.bmax);
+				if (c.count == 0 && a > bestArea) {
+					bestArea = a;
+					best = k;
+				}
+			}
+			if (best < 0)
+				break;
+			int open = slots[best];
+			slots[best] = open + 1;
+			slots[n++] = nodes[open].offset;
+		}
+
+		WideNode w;
+		w.valid = 0;
+		for (int k = 0; k < 4; k++) {
+			if (k >= n) {
+				for (int axis = 0; axis < 3; axis++)
+					w.bmin[axis][k] = w.bmax[axis][k] = 0.0f;
+				w.child[k] = -1;
+				w.count[k] = 0;
+				continue;
+			}
+			const Node& c = nodes[slots[k]];
+			for (int axis = 0; axis < 3; axis++) {
+				w.bmin[axis][k] = (float)(c.bmin[axis] - widePad);
+				w.bmax[axis][k] = (float)(c.bmax[axis] + widePad);
+			}
+			w.valid |= 1 << k;
+			if (c.count > 0) {
+				w.child[k] = c.offset;
+				w.count[k] = c.count;
+			} else {
+				w.child[k] = collapse(slots[k]);
+				w.count[k] = 0;
+			}
+		}
+		wideNodes[self] = w;
+		return self;
+	}
+
+	struct Bin {
+		glm::dvec3 bmin;
+		glm::dvec3 bmax;
+		int count;
+
+		void add(const glm::dvec3& lo, const glm::dvec3& hi, int n = 1)
+		{
+			bmin = count ? glm::min(bmin, lo) : lo;
+			bmax = count ? glm::max(bmax, hi) : hi;
+			count += n;
+		}
+
+		void merge(const Bin& b)
+		{
+			if (b.count)
+				add(b.bmin, b.bmax, b.count);
+		}
+	};
+
+	// The best split found for a node.  An object split sends each
+	// reference to one side by the bin of its centroid; a spatial split
+	// cuts at plane and sends straddling references to both sides.
+	struct Split {
+		double cost = 1.0e308;
+		int axis = -1;
+		int bin = -1;
+		double plane = 0.0;
+		int added = 0; // references a spatial split adds
+		glm::dvec3 lmin, lmax, rmin, rmax;
+	};
+
+	struct BuildState {
+		std::atomic<int> spareRefs; // left for spatial splits to add
+		double minOverlap;
+		int packWidth;
+	};
+
+	static double leafCost(const BuildState& state, int n)
+	{
+		if (state.packWidth == 1)
+			return INTERSECT_COST * n;
+		int packs = (n + state.packWidth - 1) / state.packWidth;
+		return INTERSECT_COST * PACK_COST * packs;
+	}
+
+	// The output of building one subtree: interior offsets index nodes
+	// and leaf offsets index ids, so a subtree built on another thread
+	// is spliced in by shifting them.
+	struct Subtree {
+		std::vector<Node> nodes;
+		std::vector<int32_t> ids;
+	};
+
+	static int binIndex(double c, double cmin, double scale)
+	{
+		return std::min((int)((c - cmin) * scale), BIN_COUNT - 1);
+	}
+
+	static double overlapArea(const Split& s)
+	{
+		glm::dvec3 lo = glm::max(s.lmin, s.rmin);
+		glm::dvec3 hi = glm::min(s.lmax, s.rmax);
+		for (int axis = 0; axis < 3; axis++)
+			if (lo[axis] > hi[axis])
+				return 0.0;
+		return area(lo, hi);
+	}
+
+	// Bounds of the part of ref within [lo, hi] along axis, inside the
+	// box ref has already been clipped to.  False if nothing is left.
+	static bool clipRef(const Prims& set, const BuildPrim& ref,
+	                    int axis, double lo, double hi, glm::dvec3& bmin,
+	                    glm::dvec3& bmax)
+	{
+		if (!set.clipPrimitive(ref.index, axis, lo, hi, bmin, bmax))
+			return false;
+		bmin = glm::max(bmin, ref.bmin);
+		bmax = glm::min(bmax, ref.bmax);
+		bmin[axis] = std::max(bmin[axis], lo);
+		bmax[axis] = std::min(bmax[axis], hi);
+		for (int k = 0; k < 3; k++)
+			if (bmin[k] > bmax[k])
+				return false;
+		return true;
+	}
+
+	static void makeLeaf(const std::vector<BuildPrim>& refs, Node& node,
+	                     Subtree& out)
+	{
+		node.offset = (int)out.ids.size();
+		node.count = (int)refs.size();
+		for (const BuildPrim& ref : refs)
+			out.ids.push_back(ref.index);
+	}
+
+	// Bin the centroids along each axis and evaluate the SAH at every
+	// boundary between bins.
+	static Split findObjectSplit(const std::vector<BuildPrim>& refs,
+	                             const glm::dvec3& cmin,
+	                             const glm::dvec3& cmax, double nodeArea)
+	{
+		Split best;
+		for (int axis = 0; axis < 3; axis++) {
+			if (cmin[axis] == cmax[axis])
+				continue;
+			double scale = BIN_COUNT / (cmax[axis] - cmin[axis]);
+			Bin bins[BIN_COUNT];
+			for (Bin& b : bins)
+				b.count = 0;
+			for (const BuildPrim& ref : refs)
+				bins[binIndex(ref.centroid[axis], cmin[axis], scale)]
+				        .add(ref.bmin, ref.bmax);
+
+			// right[b] covers bins b and above.
+			Bin right[BIN_COUNT];
+			right[BIN_COUNT - 1] = bins[BIN_COUNT - 1];
+			for (int b = BIN_COUNT - 2; b > 0; b--) {
+				right[b] = right[b + 1];
+				right[b].merge(bins[b]);
+			}
+			Bin left = bins[0];
+			for (int b = 1; b < BIN_COUNT; b++) {
+				if (left.count && right[b].count) {
+					double cost =
+					        TRAVERSAL_COST +
+					        INTERSECT_COST *
+					                (area(left.bmin, left.bmax) *
+					                         left.count +
+					                 area(right[b].bmin,
+					                      right[b].bmax) *
+					                         right[b].count) /
+					                nodeArea;
+					if (cost < best.cost) {
+						best.cost = cost;
+						best.axis = axis;
+						best.bin = b;
+						best.lmin = left.bmin;
+						best.lmax = left.bmax;
+						best.rmin = right[b].bmin;
+						best.rmax = right[b].bmax;
+					}
+				}
+				left.merge(bins[b]);
+			}
+		}
+		return best;
+	}
+
+	// Bin the node's extent along each axis, clipping every reference
+	// into each bin it spans, and evaluate the SAH at every boundary.
+	// A reference is counted on the left of a boundary if it starts
+	// before it and on the right if it ends after it.
+	static Split findSpatialSplit(const Prims& set,
+	                              const std::vector<BuildPrim>& refs,
+	                              const Node& node, double nodeArea)
+	{
+		Split best;
+		int n = (int)refs.size();
+		for (int axis = 0; axis < 3; axis++) {
+			double origin = node.bmin[axis];
+			double width = (node.bmax[axis] - origin) / BIN_COUNT;
+			if (!(width > 0.0))
+				continue;
+			double scale = 1.0 / width;
+			Bin bins[BIN_COUNT];
+			int entries[BIN_COUNT] = {}, exits[BIN_COUNT] = {};
+			for (Bin& b : bins)
+				b.count = 0;
+			for (const BuildPrim& ref : refs) {
+				int first = binIndex(ref.bmin[axis], origin, scale);
+				int last = binIndex(ref.bmax[axis], origin, scale);
+				glm::dvec3 bmin, bmax;
+				for (int b = first; b <= last; b++) {
+					double lo = b == first ? ref.bmin[axis]
+					                       : origin + b * width;
+					double hi = b == last ? ref.bmax[axis]
+					                      : origin + (b + 1) * width;
+					if (first == last) {
+						bins[b].add(ref.bmin, ref.bmax);
+					} else if (clipRef(set, ref, axis, lo, hi, bmin,
+					                   bmax)) {
+						bins[b].add(bmin, bmax);
+					}
+				}
+				entries[first]++;
+				exits[last]++;
+			}
+
+			Bin right[BIN_COUNT];
+			int rightCount[BIN_COUNT];
+			right[BIN_COUNT - 1] = bins[BIN_COUNT - 1];
+			rightCount[BIN_COUNT - 1] = exits[BIN_COUNT - 1];
+			for (int b = BIN_COUNT - 2; b > 0; b--) {
+				right[b] = right[b + 1];
+				right[b].merge(bins[b]);
+				rightCount[b] = rightCount[b + 1] + exits[b];
+			}
+			Bin left = bins[0];
+			int leftCount = entries[0];
+			for (int b = 1; b < BIN_COUNT; b++) {
+				if (leftCount && rightCount[b] && left.count &&
+				    right[b].count) {
+					double cost =
+					        TRAVERSAL_COST +
+					        INTERSECT_COST *
+					                (area(left.bmin, left.bmax) *
+					                         leftCount +
+					                 area(right[b].bmin,
+					                      right[b].bmax) *
+					                         rightCount[b]) /
+					                nodeArea;
+					if (cost < best.cost) {
+						best.cost = cost;
+						best.axis = axis;
+						best.plane = origin + b * width;
+						best.added = leftCount + rightCount[b] - n;
+					}
+				}
+				left.merge(bins[b]);
+				leftCount += entries[b];
+			}
+		}
+		return best;
+	}
+
+	// Take count references from the spatial split budget, if it has
+	// that many left.
+	static bool reserveRefs(BuildState& state, int count)
+	{
+		int spare = state.spareRefs.load();
+		do {
+			if (spare < count)
+				return false;
+		} while (!state.spareRefs.compare_exchange_weak(spare,
+		                                                spare - count));
+		return true;
+	}
+
+	// Build the subtree over refs into out.  refs is consumed.
+	void buildNode(const Prims& set,
+	               std::vector<BuildPrim>& refs, int depth, int threads,
+	               BuildState& state, Subtree& out)
+	{
+		int self = (int)out.nodes.size();
+		out.nodes.push_back(Node());
+		Node node;
+		node.bmin = refs[0].bmin;
+		node.bmax = refs[0].bmax;
+		glm::dvec3 cmin = refs[0].centroid;
+		glm::dvec3 cmax = refs[0].centroid;
+		for (const BuildPrim& ref : refs) {
+			node.bmin = glm::min(node.bmin, ref.bmin);
+			node.bmax = glm::max(node.bmax, ref.bmax);
+			cmin = glm::min(cmin, ref.centroid);
+			cmax = glm::max(cmax, ref.centroid);
+		}
+		node.axis = 0;
+
+		int n = (int)refs.size();
+		if (n == 1 || depth >= MAX_STACK - 1 || cmin == cmax) {
+			makeLeaf(refs, node, out);
+			out.nodes[self] = node;
+			return;
+		}
+
+		double nodeArea = area(node.bmin, node.bmax);
+		Split best = findObjectSplit(refs, cmin, cmax, nodeArea);
+		Split spatial;
+		if (best.axis >= 0 && state.spareRefs.load() > 0 &&
+		    overlapArea(best) > state.minOverlap)
+			spatial = findSpatialSplit(set, refs, node, nodeArea);
+		double bestCost = std::min(best.cost, spatial.cost);
+
+		if (n <= MAX_LEAF_SIZE && bestCost >= leafCost(state, n)) {
+			makeLeaf(refs, node, out);
+			out.nodes[self] = node;
+			return;
+		}
+
+		std::vector<BuildPrim> left, right;
+		if (spatial.cost < best.cost &&
+		    reserveRefs(state, spatial.added)) {
+			int axis = spatial.axis;
+			double plane = spatial.plane;
+			for (const BuildPrim& ref : refs) {
+				if (ref.bmax[axis] <= plane) {
+					left.push_back(ref);
+				} else if (ref.bmin[axis] >= plane) {
+					right.push_back(ref);
+				} else {
+					BuildPrim l = ref, r = ref;
+					bool inLeft = clipRef(set, ref, axis, ref.bmin[axis],
+					                      plane, l.bmin, l.bmax);
+					bool inRight = clipRef(set, ref, axis, plane,
+					                       ref.bmax[axis], r.bmin, r.bmax);
+					if (inLeft) {
+						l.centroid = 0.5 * (l.bmin + l.bmax);
+						left.push_back(l);
+					}
+					if (inRight) {
+						r.centroid = 0.5 * (r.bmin + r.bmax);
+						right.push_back(r);
+					}
+					// Never lose a reference to rounding.
+					if (!inLeft && !inRight) {
+						if (ref.centroid[axis] < plane)
+							left.push_back(ref);
+						else
+							right.push_back(ref);
+					}
+				}
+			}
+			int added = (int)(left.size() + right.size()) - n;
+			state.spareRefs += spatial.added - added;
+			node.axis = axis;
+			if (left.empty() || right.empty()) {
+				left.clear();
+				right.clear();
+			}
+		}
+
+		if (left.empty() && best.axis >= 0) {
+			int axis = best.axis;
+			double scale = BIN_COUNT / (cmax[axis] - cmin[axis]);
+			for (const BuildPrim& ref : refs) {
+				if (binIndex(ref.centroid[axis], cmin[axis], scale) <
+				    best.bin)
+					left.push_back(ref);
+				else
+					right.push_back(ref);
+			}
+			node.axis = axis;
+		} else if (left.empty()) {
+			// Degenerate (zero-area) node: fall back to a median split
+			// along the widest spread of centroids.
+			glm::dvec3 spread = cmax - cmin;
+			int axis = 0;
+			for (int k = 1; k < 3; k++)
+				if (spread[k] > spread[axis])
+					axis = k;
+			auto mid = refs.begin() + n / 2;
+			std::nth_element(refs.begin(), mid, refs.end(),
+			                 [axis](const BuildPrim& a,
+			                        const BuildPrim& b) {
+				                 return a.centroid[axis] <
+				                        b.centroid[axis];
+			                 });
+			left.assign(refs.begin(), mid);
+			right.assign(mid, refs.end());
+			node.axis = axis;
+		}
+		std::vector<BuildPrim>().swap(refs);
+
+		node.count = 0;
+		if (threads > 1 && n >= PARALLEL_MIN) {
+			// Fork the second child onto a new thread with its share
+			// of the remaining threads, then join and splice it in.
+			Subtree second;
+			int mine = threads / 2;
+			std::thread worker([&, depth, threads, mine]() {
+				buildNode(set, right, depth + 1, threads - mine, state,
+				          second);
+			});
+			buildNode(set, left, depth + 1, mine, state, out);
+			worker.join();
+			int nodeBase = (int)out.nodes.size();
+			int idBase = (int)out.ids.size();
+			node.offset = nodeBase;
+			for (Node c : second.nodes) {
+				c.offset += c.count > 0 ? idBase : nodeBase;
+				out.nodes.push_back(c);
+			}
+			out.ids.insert(out.ids.end(), second.ids.begin(),
+			               second.ids.end());
+		} else {
+			buildNode(set, left, depth + 1, 1, state, out);
+			node.offset = (int)out.nodes.size();
+			buildNode(set, right, depth + 1, 1, state, out);
+		}
+		out.nodes[self] = node;
+	}
+
+	// A built tree owns its nodes and ids; a loaded one reads them from
+	// backing.
+	std::vector<Node> nodes;
+	std::vector<WideNode> wideNodes;
+	const Node* nodeData = nullptr;
+	int numNodes = 0;
+	const WideNode* wideData = nullptr;
+	int numWide = 0;
+	std::shared_ptr<const void> backing;
+
+	double widePad = 0.0;
+	const Prims* prims;
+	// The primitive each leaf entry refers to.
+	std::vector<int32_t> primIds;
+	const int32_t* idData = nullptr;
+	int numIds = 0;
+};
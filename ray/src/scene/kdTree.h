@@ -1,3 +1,430 @@
 #pragma once
 
-// Note: you can put kd-tree here
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+#include "bbox.h"
+#include "ray.h"
+#include "rayPacket.h"
+
+// A kd-tree over any Obj that provides getBoundingBox(),
+// intersect(ray&, isect&), intersectPacket(RayPacket&) and
+// occlude(ray&, tMax, atten).  Split planes are chosen with the surface
+// area heuristic (SAH); an object straddling a split plane is referenced
+// from both children, so leaves may share objects.
+//
+// Nodes are stored depth-first in one flat array: the "below" child of an
+// interior node immediately follows it, and the "above" child is found at
+// Node::above.
+template <typename Obj>
+class KdTree {
+public:
+	// Build a tree over objs, all of which must lie inside bounds.
+	// Recursion stops at maxDepth, or when a node holds no more than
+	// leafSize objects, or when no split is cheaper than a leaf.
+	KdTree(const std::vector<Obj*>& objs, const BoundingBox& bounds,
+	       int maxDepth, int leafSize)
+	        : bounds(bounds), maxDepth(maxDepth),
+	          leafSize(std::max(leafSize, 1))
+	{
+		numObjects = objs.size();
+		std::vector<Box> boxes;
+		boxes.reserve(objs.size());
+		for (auto obj : objs) {
+			const BoundingBox& b = obj->getBoundingBox();
+			boxes.push_back(Box{b.getMin(), b.getMax()});
+		}
+		std::vector<int> all(objs.size());
+		for (size_t k = 0; k < all.size(); k++)
+			all[k] = (int)k;
+		buildNode(objs, boxes, all,
+		          Box{bounds.getMin(), bounds.getMax()}, 0);
+	}
+
+	// Closest hit along r, in the same space as the objects' bounding
+	// boxes.  Returns false and leaves i untouched on a miss.
+	bool intersect(ray& r, isect& i) const
+	{
+		double tmin, tmax;
+		if (!bounds.intersect(r, tmin, tmax))
+			return false;
+		tmin = std::max(tmin, 0.0);
+
+		glm::dvec3 p = r.getPosition();
+		glm::dvec3 d = r.getDirection();
+		glm::dvec3 invDir(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+
+		struct Todo {
+			int node;
+			double tmin, tmax;
+		};
+		Todo todo[MAX_STACK];
+		int todoSize = 0;
+
+		bool have_one = false;
+		int cur = 0;
+		for (;;) {
+			if (have_one && i.getT() < tmin)
+				break;
+			const Node& node = nodes[cur];
+			if (!node.isLeaf()) {
+				int axis = node.axis;
+				double tPlane = (node.split - p[axis]) * invDir[axis];
+				bool belowFirst = p[axis] < node.split ||
+				                  (p[axis] == node.split && d[axis] <= 0);
+				int first = belowFirst ? cur + 1 : node.above;
+				int second = belowFirst ? node.above : cur + 1;
+
+				if (tPlane > tmax || tPlane <= 0) {
+					cur = first;
+				} else if (tPlane < tmin) {
+					cur = second;
+				} else {
+					todo[todoSize++] = Todo{second, tPlane, tmax};
+					cur = first;
+					tmax = tPlane;
+				}
+				continue;
+			}
+
+			for (int k = 0; k < node.count; k++) {
+				isect hit;
+				if (objRefs[node.first + k]->intersect(r, hit)) {
+					if (!have_one || hit.getT() < i.getT()) {
+						i = hit;
+						have_one = true;
+					}
+				}
+			}
+
+			if (todoSize == 0)
+				break;
+			--todoSize;
+			cur = todo[todoSize].node;
+			tmin = todo[todoSize].tmin;
+			tmax = todo[todoSize].tmax;
+		}
+		return have_one;
+	}
+
+	// The closest hit of every ray of packet, as intersect() would find
+	// for each ray alone, left in the packet by each leaf object's
+	// intersectPacket().  Nodes are visited front to back along the
+	// packet's central direction, and skipped if they are outside its
+	// frustum or farther away than every ray's hit so far.
+	void intersectPacket(RayPacket& packet) const
+	{
+		const Frustum& frustum = packet.getFrustum();
+		const glm::dvec3& p = frustum.getOrigin();
+		const glm::dvec3& center = frustum.getCenter();
+
+		struct Todo {
+			int node;
+			Box box;
+		};
+		Todo todo[MAX_STACK];
+		int todoSize = 0;
+
+		int cur = 0;
+		Box box{bounds.getMin(), bounds.getMax()};
+		for (;;) {
+			if (frustum.mayHit(box.min, box.max) &&
+			    box.distance(p) <= packet.farthestHit()) {
+				const Node& node = nodes[cur];
+				if (!node.isLeaf()) {
+					int axis = node.axis;
+					Box below = box, above = box;
+					below.max[axis] = node.split;
+					above.min[axis] = node.split;
+					bool belowFirst =
+					        p[axis] < node.split ||
+					        (p[axis] == node.split && center[axis] <= 0);
+					if (belowFirst) {
+						todo[todoSize++] = Todo{node.above, above};
+						cur = cur + 1;
+						box = below;
+					} else {
+						todo[todoSize++] = Todo{cur + 1, below};
+						cur = node.above;
+						box = above;
+					}
+					continue;
+				}
+				for (int k = 0; k < node.count; k++)
+					objRefs[node.first + k]->intersectPacket(packet);
+			}
+			if (todoSize == 0)
+				break;
+			--todoSize;
+			cur = todo[todoSize].node;
+			box = todo[todoSize].box;
+		}
+	}
+
+	// Whether an opaque object lies along r closer than tMax, as
+	// Scene::occluded() defines it, through each object's occlude().
+	// Leaves are visited front to back, stopping at the first that
+	// blocks r.  An object referenced by several leaves is only tested
+	// once, so that its kt is not applied twice: occlude() covers all of
+	// [0, tMax].  Each thread numbers its queries and stamps an object,
+	// by its index in the objects the tree was built over, with the
+	// query that tested it.  If blocker is not null, the object that
+	// blocked r is stored there.
+	bool occluded(ray& r, double tMax, glm::dvec3& atten,
+	              const Obj** blocker = nullptr) const
+	{
+		double tmin, tmax;
+		if (!bounds.intersect(r, tmin, tmax))
+			return false;
+		tmin = std::max(tmin, 0.0);
+		tmax = std::min(tmax, tMax);
+		if (tmin > tmax)
+			return false;
+
+		glm::dvec3 p = r.getPosition();
+		glm::dvec3 d = r.getDirection();
+		glm::dvec3 invDir(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+
+		struct Todo {
+			int node;
+			double tmin, tmax;
+		};
+		Todo todo[MAX_STACK];
+		int todoSize = 0;
+
+		static thread_local std::vector<uint32_t> stamps;
+		static thread_local uint32_t query = 0;
+		if (stamps.size() < numObjects)
+			stamps.resize(numObjects, 0);
+		if (++query == 0) {
+			std::fill(stamps.begin(), stamps.end(), 0);
+			query = 1;
+		}
+		int cur = 0;
+		for (;;) {
+			const Node& node = nodes[cur];
+			if (!node.isLeaf()) {
+				int axis = node.axis;
+				double tPlane = (node.split - p[axis]) * invDir[axis];
+				bool belowFirst = p[axis] < node.split ||
+				                  (p[axis] == node.split && d[axis] <= 0);
+				int first = belowFirst ? cur + 1 : node.above;
+				int second = belowFirst ? node.above : cur + 1;
+
+				if (tPlane > tmax || tPlane <= 0) {
+					cur = first;
+				} else if (tPlane < tmin) {
+					cur = second;
+				} else {
+					todo[todoSize++] = Todo{second, tPlane, tmax};
+					cur = first;
+					tmax = tPlane;
+				}
+				continue;
+			}
+
+			for (int k = 0; k < node.count; k++) {
+				int id = refIds[node.first + k];
+				if (stamps[id] == query)
+					continue;
+				stamps[id] = query;
+				const Obj* obj = objRefs[node.first + k];
+				if (obj->occlude(r, tMax, atten)) {
+					if (blocker)
+						*blocker = obj;
+					return true;
+				}
+			}
+
+			if (todoSize == 0)
+				break;
+			--todoSize;
+			cur = todo[todoSize].node;
+			tmin = todo[todoSize].tmin;
+			tmax = todo[todoSize].tmax;
+		}
+		return false;
+	}
+
+	int nodeCount() const { return (int)nodes.size(); }
+
+private:
+	// Relative costs used by the SAH: one traversal step versus one
+	// object intersection, and the discount for cutting off empty space.
+	static constexpr double TRAVERSAL_COST = 1.0;
+	static constexpr double INTERSECT_COST = 1.5;
+	static constexpr double EMPTY_BONUS = 0.2;
+	static constexpr int MAX_STACK = 64;
+
+	struct Box {
+		glm::dvec3 min;
+		glm::dvec3 max;
+
+		double area() const
+		{
+			glm::dvec3 e = max - min;
+			return 2.0 * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+		}
+
+		// Distance from p to the nearest point of the box.
+		double distance(const glm::dvec3& p) const
+		{
+			glm::dvec3 d = glm::max(glm::max(min - p, p - max),
+			                        glm::dvec3(0.0));
+			return std::sqrt(glm::dot(d, d));
+		}
+	};
+
+	struct Node {
+		double split;
+		int axis;  // 0-2 for interior nodes, LEAF for leaves
+		int above; // interior: index of the child above the plane
+		int first; // leaf: first entry in objRefs
+		int count; // leaf: number of objects
+
+		static constexpr int LEAF = 3;
+		bool isLeaf() const { return axis == LEAF; }
+	};
+
+	struct Edge {
+		double t;
+		bool start;
+
+		bool operator<(const Edge& e) const
+		{
+			if (t == e.t)
+				return start && !e.start;
+			return t < e.t;
+		}
+	};
+
+	void makeLeaf(const std::vector<Obj*>& objs,
+	              const std::vector<int>& ids)
+	{
+		Node leaf;
+		leaf.split = 0.0;
+		leaf.axis = Node::LEAF;
+		leaf.above = -1;
+		leaf.first = (int)objRefs.size();
+		leaf.count = (int)ids.size();
+		for (int id : ids) {
+			objRefs.push_back(objs[id]);
+			refIds.push_back(id);
+		}
+		nodes.push_back(leaf);
+	}
+
+	void buildNode(const std::vector<Obj*>& objs,
+	               const std::vector<Box>& boxes,
+	               const std::vector<int>& ids, const Box& nodeBox,
+	               int depth)
+	{
+		int n = (int)ids.size();
+		// MAX_STACK bounds the traversal stack, which grows by at
+		// most one entry per level.
+		if (n <= leafSize || depth >= std::min(maxDepth, (int)MAX_STACK)) {
+			makeLeaf(objs, ids);
+			return;
+		}
+
+		double totalArea = nodeBox.area();
+		double leafCost = INTERSECT_COST * n;
+		double bestCost = leafCost;
+		int bestAxis = -1;
+		double bestSplit = 0.0;
+
+		std::vector<Edge> edges(2 * n);
+		glm::dvec3 extent = nodeBox.max - nodeBox.min;
+		for (int axis = 0; axis < 3 && totalArea > 0.0; axis++) {
+			for (int k = 0; k < n; k++) {
+				const Box& b = boxes[ids[k]];
+				edges[2 * k] = Edge{b.min[axis], true};
+				edges[2 * k + 1] = Edge{b.max[axis], false};
+			}
+			std::sort(edges.begin(), edges.end());
+
+			int otherA = (axis + 1) % 3, otherB = (axis + 2) % 3;
+			double capArea = 2.0 * extent[otherA] * extent[otherB];
+			double sideLen = extent[otherA] + extent[otherB];
+
+			int nBelow = 0, nAbove = n;
+			for (const Edge& e : edges) {
+				if (!e.start)
+					--nAbove;
+				double t = e.t;
+				if (t > nodeBox.min[axis] && t < nodeBox.max[axis]) {
+					double belowArea =
+					        capArea +
+					        2.0 * (t - nodeBox.min[axis]) * sideLen;
+					double aboveArea =
+					        capArea +
+					        2.0 * (nodeBox.max[axis] - t) * sideLen;
+					double bonus = (nBelow == 0 || nAbove == 0)
+					                       ? EMPTY_BONUS
+					                       : 0.0;
+					double cost =
+					        TRAVERSAL_COST +
+					        INTERSECT_COST * (1.0 - bonus) *
+					                (belowArea * nBelow +
+					                 aboveArea * nAbove) /
+					                totalArea;
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestSplit = t;
+					}
+				}
+				if (e.start)
+					++nBelow;
+			}
+		}
+
+		if (bestAxis < 0) {
+			makeLeaf(objs, ids);
+			return;
+		}
+
+		std::vector<int> below, above;
+		for (int id : ids) {
+			const Box& b = boxes[id];
+			if (b.min[bestAxis] < bestSplit)
+				below.push_back(id);
+			if (b.max[bestAxis] > bestSplit)
+				above.push_back(id);
+			// Flat boxes lying exactly on the plane go below.
+			if (b.min[bestAxis] == bestSplit &&
+			    b.max[bestAxis] == bestSplit)
+				below.push_back(id);
+		}
+
+		Box belowBox = nodeBox, aboveBox = nodeBox;
+		belowBox.max[bestAxis] = bestSplit;
+		aboveBox.min[bestAxis] = bestSplit;
+
+		int self = (int)nodes.size();
+		Node interior;
+		interior.split = bestSplit;
+		interior.axis = bestAxis;
+		interior.above = -1;
+		interior.first = 0;
+		interior.count = 0;
+		nodes.push_back(interior);
+
+		buildNode(objs, boxes, below, belowBox, depth + 1);
+		nodes[self].above = (int)nodes.size();
+		buildNode(objs, boxes, above, aboveBox, depth + 1);
+	}
+
+	BoundingBox bounds;
+	int maxDepth;
+	int leafSize;
+	std::vector<Node> nodes;
+	std::vector<Obj*> objRefs;
+	std::vector<int> refIds; // index in objs of each objRefs entry
+	size_t numObjects = 0;
+};
@@ -1,5 +1,6 @@
 #include <cmath>
 #include <iostream>
+#include <limits>
 
 #include "light.h"
 #include <glm/glm.hpp>
@@ -8,6 +9,30 @@
 
 using namespace std;
 
+glm::dvec3 Light::occlusion(const ray& r, const glm::dvec3& p,
+                            const glm::dvec3& d, double tMax) const
+{
+	ray shadow(p, d, r.getAtten(), ray::SHADOW);
+	glm::dvec3 atten(1.0, 1.0, 1.0);
+	unsigned int id = ray_thread_id;
+	// Threads outside the workers share a slot, so they get no cache.
+	Occluder* cache = id < OTHER_THREADS ? &lastOccluder[id] : nullptr;
+	if (cache && cache->obj) {
+		bool hit = cache->obj->occlude(shadow, tMax, atten);
+		TraceUI::addOccluderProbe(id, hit);
+		if (hit)
+			return glm::dvec3(0.0, 0.0, 0.0);
+		// The full query applies its kt again, so start over.
+		atten = glm::dvec3(1.0, 1.0, 1.0);
+	}
+
+	const Geometry* blocker = nullptr;
+	bool blocked = scene->occluded(shadow, tMax, atten, &blocker);
+	if (cache)
+		cache->obj = blocker;
+	return blocked ? glm::dvec3(0.0, 0.0, 0.0) : atten;
+}
+
 double DirectionalLight::distanceAttenuation(const glm::dvec3& P) const
 {
 	// distance to light is infinite, so f(di) goes to 0.  Return 1.
@@ -15,11 +40,14 @@ double DirectionalLight::distanceAttenuation(const glm::dvec3& P) const
 }
 
 
+// What reaches p from the light: nothing if an opaque object is in the
+// way, else the light filtered by the kt of every transmissive surface it
+// passes through.  Only the occlusion query is needed, not the closest
+// hit.
 glm::dvec3 DirectionalLight::shadowAttenuation(const ray& r, const glm::dvec3& p) const
 {
-	// YOUR CODE HERE:
-	// You should implement shadow-handling code here.
-	return glm::dvec3(1.0, 1.0, 1.0);
+	return occlusion(r, p, getDirection(p),
+	                 std::numeric_limits<double>::infinity());
 }
 
 glm::dvec3 DirectionalLight::getColor() const
@@ -34,13 +62,9 @@ glm::dvec3 DirectionalLight::getDirection(const glm::dvec3& P) const
 
 double PointLight::distanceAttenuation(const glm::dvec3& P) const
 {
-
-	// YOUR CODE HERE
-
-	// You'll need to modify this method to attenuate the intensity 
-	// of the light based on the distance between the source and the 
-	// point P.  For now, we assume no attenuation and just return 1.0
-	return 1.0;
+	double d = glm::distance(position, P);
+	return std::min(1.0, 1.0 / (constantTerm + linearTerm * d +
+	                            quadraticTerm * d * d));
 }
 
 glm::dvec3 PointLight::getColor() const
@@ -54,11 +78,35 @@ glm::dvec3 PointLight::getDirection(const glm::dvec3& P) const
 }
 
 
+// Where f(d) = 1/(a + b d + c d^2) falls to epsilon / max(color): the
+// larger root of c d^2 + b d + a - max(color) / epsilon.  A light that is
+// dimmer than epsilon even at full strength matters nowhere.
+bool PointLight::getInfluence(double epsilon, glm::dvec3& center,
+                              double& radius) const
+{
+	if (!(epsilon > 0.0))
+		return false;
+	double brightest = std::max(color[0], std::max(color[1], color[2]));
+	double k = brightest / epsilon;
+	double a = constantTerm, b = linearTerm, c = quadraticTerm;
+	if (a >= k) {
+		radius = 0.0;
+	} else if (c > 0.0) {
+		radius = (-b + std::sqrt(b * b + 4.0 * c * (k - a))) / (2.0 * c);
+	} else if (b > 0.0) {
+		radius = (k - a) / b;
+	} else {
+		return false;
+	}
+	center = position;
+	return true;
+}
+
+// As for a directional light, but only objects between p and the light
+// can cast a shadow.
 glm::dvec3 PointLight::shadowAttenuation(const ray& r, const glm::dvec3& p) const
 {
-	// YOUR CODE HERE:
-	// You should implement shadow-handling code here.
-	return glm::dvec3(1,1,1);
+	return occlusion(r, p, getDirection(p), glm::distance(position, p));
 }
 
 #define VERBOSE 0
@@ -20,12 +20,41 @@ public:
 	virtual glm::dvec3 getColor() const = 0;
 	virtual glm::dvec3 getDirection (const glm::dvec3& P) const = 0;
 
+	// Whether the light only matters near it: if so, center and radius
+	// are set to the sphere outside of which getColor() times
+	// distanceAttenuation() is below epsilon in every channel.  Lights
+	// that do not fade with distance have no such sphere.
+	virtual bool getInfluence(double epsilon, glm::dvec3& center,
+	                          double& radius) const
+	{
+		return false;
+	}
+
 
 protected:
 	Light(Scene *scene, const glm::dvec3& col) : SceneElement(scene), color(col) {}
 
+	// What reaches p from the light, which is in direction d and tMax
+	// away: the occlusion query behind shadowAttenuation().
+	glm::dvec3 occlusion(const ray& r, const glm::dvec3& p,
+	                     const glm::dvec3& d, double tMax) const;
+
 	glm::dvec3 color;
 
+private:
+	// The object that last blocked this light, for each render thread.
+	// Neighbouring points are usually shadowed by the same object, so it
+	// is tried on its own before the whole scene is searched.  Only
+	// objects that blocked the light outright are kept: a transmissive
+	// one would need every other surface along the ray as well.  Padded
+	// to a cache line per thread, as for the ray counters; lights are
+	// allocated with plain new, so alignas would not be honoured.
+	struct Occluder {
+		const Geometry* obj = nullptr;
+		char pad[64 - sizeof(const Geometry*)];
+	};
+	mutable Occluder lastOccluder[MAX_THREADS];
+
 public:
 	virtual void glDraw(GLenum lightID) const { }
 	virtual void glDraw() const { }
@@ -67,6 +96,8 @@ public:
 	virtual double distanceAttenuation(const glm::dvec3& P) const;
 	virtual glm::dvec3 getColor() const;
 	virtual glm::dvec3 getDirection(const glm::dvec3& P) const;
+	virtual bool getInfluence(double epsilon, glm::dvec3& center,
+	                          double& radius) const;
 
 	void setAttenuationConstants(float a, float b, float c)
 	{
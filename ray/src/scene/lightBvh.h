@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+// A bounding volume hierarchy over the spheres of influence of lights
+// that fade with distance: outside its sphere a light is too dim to
+// matter, so the lights that can light a point are found by descending
+// only into the boxes that contain it, rather than by trying every light.
+//
+// Nodes are stored depth-first in one flat array, as in KdTree: the left
+// child of an interior node immediately follows it, and the right child
+// is found at Node::right.
+class LightBvh {
+public:
+	struct Sphere {
+		glm::dvec3 center;
+		double radius;
+		int light; // passed back by visit()
+	};
+
+	explicit LightBvh(std::vector<Sphere> all) : spheres(std::move(all))
+	{
+		if (!spheres.empty())
+			buildNode(0, (int)spheres.size());
+	}
+
+	// Call f(light) for every sphere that contains p.
+	template <typename F>
+	void visit(const glm::dvec3& p, F f) const
+	{
+		if (nodes.empty())
+			return;
+		int todo[MAX_STACK];
+		int todoSize = 0;
+		int cur = 0;
+		for (;;) {
+			const Node& node = nodes[cur];
+			if (node.contains(p)) {
+				if (node.count > 0) {
+					for (int k = node.first;
+					     k < node.first + node.count; k++) {
+						const Sphere& s = spheres[k];
+						glm::dvec3 v = p - s.center;
+						if (glm::dot(v, v) <= s.radius * s.radius)
+							f(s.light);
+					}
+				} else {
+					todo[todoSize++] = node.right;
+					cur = cur + 1;
+					continue;
+				}
+			}
+			if (todoSize == 0)
+				break;
+			cur = todo[--todoSize];
+		}
+	}
+
+private:
+	static constexpr int LEAF_SIZE = 4;
+	static constexpr int MAX_STACK = 64;
+
+	struct Node {
+		glm::dvec3 bmin, bmax;
+		int first, count; // spheres of a leaf; count is 0 if interior
+		int right;        // right child of an interior node
+
+		bool contains(const glm::dvec3& p) const
+		{
+			return p[0] >= bmin[0] && p[0] <= bmax[0] &&
+			       p[1] >= bmin[1] && p[1] <= bmax[1] &&
+			       p[2] >= bmin[2] && p[2] <= bmax[2];
+		}
+	};
+
+	// Build the subtree over spheres [first, last), splitting at the
+	// median center along the axis where the centers spread most.  The
+	// depth is logarithmic, so the stack in visit() cannot overflow.
+	int buildNode(int first, int last)
+	{
+		int index = (int)nodes.size();
+		nodes.push_back(Node());
+		glm::dvec3 bmin = spheres[first].center - spheres[first].radius;
+		glm::dvec3 bmax = spheres[first].center + spheres[first].radius;
+		glm::dvec3 cmin = spheres[first].center;
+		glm::dvec3 cmax = spheres[first].center;
+		for (int k = first + 1; k < last; k++) {
+			const Sphere& s = spheres[k];
+			bmin = glm::min(bmin, s.center - s.radius);
+			bmax = glm::max(bmax, s.center + s.radius);
+			cmin = glm::min(cmin, s.center);
+			cmax = glm::max(cmax, s.center);
+		}
+		nodes[index].bmin = bmin;
+		nodes[index].bmax = bmax;
+
+		if (last - first <= LEAF_SIZE) {
+			nodes[index].first = first;
+			nodes[index].count = last - first;
+			nodes[index].right = -1;
+			return index;
+		}
+
+		glm::dvec3 extent = cmax - cmin;
+		int axis = 0;
+		if (extent[1] > extent[axis])
+			axis = 1;
+		if (extent[2] > extent[axis])
+			axis = 2;
+		int mid = (first + last) / 2;
+		std::nth_element(spheres.begin() + first, spheres.begin() + mid,
+		                 spheres.begin() + last,
+		                 [axis](const Sphere& a, const Sphere& b) {
+			                 return a.center[axis] < b.center[axis];
+		                 });
+
+		nodes[index].first = 0;
+		nodes[index].count = 0;
+		buildNode(first, mid);
+		int right = buildNode(mid, last);
+		nodes[index].right = right;
+		return index;
+	}
+
+	std::vector<Sphere> spheres;
+	std::vector<Node> nodes;
+};
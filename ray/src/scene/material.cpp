@@ -5,6 +5,8 @@
 extern TraceUI* traceUI;
 
 #include <glm/gtx/io.hpp>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include "../fileio/images.h"
 
@@ -16,36 +18,39 @@ Material::~Material()
 }
 
 // Apply the phong model to this point on the surface of the object, returning
-// the color of that point.
+// the color of that point: its emission and ambient term, plus the
+// diffuse and specular light of every light that reaches it, after
+// distance attenuation and (if enabled) shadows.
 glm::dvec3 Material::shade(Scene* scene, const ray& r, const isect& i) const
 {
-	// YOUR CODE HERE
-
-	// For now, this method just returns the diffuse color of the object.
-	// This gives a single matte color for every distinct surface in the
-	// scene, and that's it.  Simple, but enough to get you started.
-	// (It's also inconsistent with the phong model...)
+	glm::dvec3 P = r.at(i);
+	glm::dvec3 V = -r.getDirection();
+	// Light the side of the surface that is being looked at.
+	glm::dvec3 N = i.getN();
+	if (glm::dot(N, V) < 0.0)
+		N = -N;
 
-	// Your mission is to fill in this method with the rest of the phong
-	// shading model, including the contributions of all the light sources.
-	// You will need to call both distanceAttenuation() and
-	// shadowAttenuation()
-	// somewhere in your code in order to compute shadows and light falloff.
-	//	if( debugMode )
-	//		std::cout << "Debugging Phong code..." << std::endl;
-
-	// When you're iterating through the lights,
-	// you'll want to use code that looks something
-	// like this:
-	//
-	// for ( const auto& pLight : scene->getAllLights() )
-	// {
-	//              // pLight has type unique_ptr<Light>
-	// 		.
-	// 		.
-	// 		.
-	// }
-	return kd(i);
+	glm::dvec3 color = ke(i) + ka(i) * scene->ambient();
+	glm::dvec3 diffuse = kd(i);
+	glm::dvec3 specular = ks(i);
+	double shine = shininess(i);
+	// Lights too far away to matter are skipped without being looked at.
+	scene->forEachLightAt(P, [&](const Light* pLight) {
+		glm::dvec3 L = pLight->getDirection(P);
+		double NdotL = glm::dot(N, L);
+		// Lights behind the surface need no shadow ray.
+		if (NdotL <= 0.0)
+			return;
+		glm::dvec3 light = pLight->getColor() * pLight->distanceAttenuation(P);
+		if (traceUI->shadowSw())
+			light *= pLight->shadowAttenuation(r, P);
+		if (light == glm::dvec3(0.0, 0.0, 0.0))
+			return;
+		glm::dvec3 R = 2.0 * NdotL * N - L;
+		double spec = std::pow(std::max(0.0, glm::dot(R, V)), shine);
+		color += light * (diffuse * NdotL + specular * spec);
+	});
+	return color;
 }
 
 TextureMap::TextureMap(string filename)
@@ -3,9 +3,9 @@
 #include "material.h"
 #include "scene.h"
 
-const Material& isect::getMaterial() const
+Material isect::getMaterial() const
 {
-	return material ? *material : obj->getMaterial();
+	return obj->getMaterialAt(*this);
 }
 
 ray::ray(const glm::dvec3& pp,
@@ -14,12 +14,13 @@ ray::ray(const glm::dvec3& pp,
          RayType tt)
         : p(pp), d(dd), atten(w), t(tt)
 {
-	TraceUI::addRay(ray_thread_id);
+	TraceUI::addRay(ray_thread_id, tt);
 }
 
-ray::ray(const ray& other) : p(other.p), d(other.d), atten(other.atten)
+// A copy is the same ray, so it is not counted again.
+ray::ray(const ray& other)
+        : p(other.p), d(other.d), atten(other.atten), t(other.t)
 {
-	TraceUI::addRay(ray_thread_id);
 }
 
 ray::~ray()
@@ -40,4 +41,4 @@ glm::dvec3 ray::at(const isect& i) const
 	return at(i.getT());
 }
 
-thread_local unsigned int ray_thread_id = 0;
+thread_local unsigned int ray_thread_id = OTHER_THREADS;
@@ -20,6 +20,8 @@ class isect;
 
 /*
  * ray_thread_id: a thread local variable for statistical purpose.
+ * Render workers are numbered from 0; every other thread is
+ * OTHER_THREADS.
  */
 extern thread_local unsigned int ray_thread_id;
 
@@ -58,23 +60,20 @@ private:
 
 // The description of an intersection point.
 
+//
+// Candidate hits are made and copied many times during traversal, so an
+// isect is plain data: it names the object (and, for objects made of
+// several primitives, which one) and where it was hit.  The material is
+// only looked up, with getMaterial(), for the hit that is finally shaded.
 class isect {
 public:
-	isect() : obj(NULL), t(0.0), N(), material(nullptr) {}
-	isect(const isect& other)
-	{
-		copyFromOther(other);
-	}
-
-	~isect() { }
-
-	isect& operator=(const isect& other)
-	{
-		copyFromOther(other);
-		return *this;
-	}
+	isect() : obj(NULL), prim(-1), t(0.0), N() {}
 
 	void setObject(const SceneObject* o) { obj = o; }
+	const SceneObject* getObject() const { return obj; }
+	// Which of the object's primitives was hit, or -1.
+	void setPrimitive(int p) { prim = p; }
+	int getPrimitive() const { return prim; }
 
 	// Get/Set Time of flight
 	void setT(double tt) { t = tt; }
@@ -83,13 +82,6 @@ public:
 	void setN(const glm::dvec3& n) { N = n; }
 	glm::dvec3 getN() const { return N; }
 
-	void setMaterial(const Material& m)
-	{
-		if (material)
-			*material = m;
-		else
-			material.reset(new Material(m));
-	}
 	void setUVCoordinates(const glm::dvec2& coords)
 	{
 		uvCoordinates = coords;
@@ -100,35 +92,19 @@ public:
 	{
 		setBary(glm::dvec3(alpha, beta, gamma));
 	}
-	const Material& getMaterial() const;
+	glm::dvec3 getBary() const { return bary; }
 
-private:
-	void copyFromOther(const isect& other)
-	{
-		if (this == &other)
-			return ;
-		obj           = other.obj;
-		t             = other.t;
-		N             = other.N;
-		bary          = other.bary;
-		uvCoordinates = other.uvCoordinates;
-		if (other.material) {
-			setMaterial(*other.material);
-		} else {
-			material.reset();
-		}
-	}
+	// The object's material at this point (see
+	// SceneObject::getMaterialAt).
+	Material getMaterial() const;
 
+private:
 	const SceneObject* obj;
+	int prim;
 	double t;
 	glm::dvec3 N;
 	glm::dvec2 uvCoordinates;
 	glm::dvec3 bary;
-
-	// if this intersection has its own material
-	// (as opposed to one in its associated object)
-	// as in the case where the material was interpolated
-	std::unique_ptr<Material> material;
 };
 
 const double RAY_EPSILON = 0.00000001;
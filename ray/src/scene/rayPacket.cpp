@@ -0,0 +1,101 @@
+#include "rayPacket.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glm/geometric.hpp>
+
+namespace {
+// Rays lying on a plane of the frustum (the corner rays, and those along
+// the packet's edges) are within rounding of it; allow for that, relative
+// to the size of the distances involved.
+const double PLANE_SLACK = 1.0e-9;
+}
+
+void Frustum::set(const glm::dvec3& o, const glm::dvec3 corners[4])
+{
+	origin = o;
+	center = corners[0] + corners[1] + corners[2] + corners[3];
+	for (int k = 0; k < 4; k++) {
+		glm::dvec3 n = glm::cross(corners[k], corners[(k + 1) % 4]);
+		double len = glm::length(n);
+		// Two equal corners (a packet one ray wide) bound nothing.
+		if (!(len > 0.0)) {
+			normals[k] = glm::dvec3(0.0);
+			continue;
+		}
+		n /= len;
+		normals[k] = glm::dot(n, center) < 0.0 ? -n : n;
+	}
+}
+
+bool Frustum::mayHit(const glm::dvec3& bmin, const glm::dvec3& bmax) const
+{
+	for (int k = 0; k < 4; k++) {
+		// The corner of the box farthest along the inward normal.
+		const glm::dvec3& n = normals[k];
+		glm::dvec3 p(n[0] >= 0.0 ? bmax[0] : bmin[0],
+		             n[1] >= 0.0 ? bmax[1] : bmin[1],
+		             n[2] >= 0.0 ? bmax[2] : bmin[2]);
+		glm::dvec3 v = p - origin;
+		double scale = std::abs(v[0]) + std::abs(v[1]) + std::abs(v[2]);
+		if (glm::dot(n, v) < -PLANE_SLACK * scale)
+			return false;
+	}
+	return true;
+}
+
+RayPacket::RayPacket() : hitMask(0)
+{
+	rays.reserve(MAX_RAYS);
+}
+
+void RayPacket::clear()
+{
+	rays.clear();
+	hitMask = 0;
+}
+
+void RayPacket::add(const ray& r)
+{
+	int k = size();
+	rays.push_back(r);
+	glm::dvec3 d = r.getDirection();
+	invDirs[k] = glm::dvec3(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+	hits[k] = isect();
+}
+
+void RayPacket::bound(const int corners[4])
+{
+	glm::dvec3 dirs[4];
+	for (int k = 0; k < 4; k++)
+		dirs[k] = rays[corners[k]].getDirection();
+	frustum.set(rays[0].getPosition(), dirs);
+}
+
+void RayPacket::offer(int k, const isect& i)
+{
+	if (!hasHit(k) || i.getT() < hits[k].getT()) {
+		hits[k] = i;
+		setHit(k);
+	}
+}
+
+double RayPacket::maxT(int k) const
+{
+	return hasHit(k) ? hits[k].getT()
+	                 : std::numeric_limits<double>::infinity();
+}
+
+double RayPacket::farthestHit() const
+{
+	int n = size();
+	uint64_t all = n == MAX_RAYS ? ~uint64_t(0) : (uint64_t(1) << n) - 1;
+	if ((hitMask & all) != all)
+		return std::numeric_limits<double>::infinity();
+	double t = 0.0;
+	for (int k = 0; k < n; k++)
+		t = std::max(t, hits[k].getT());
+	return t;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "ray.h"
+
+// The part of space that a bundle of rays from one origin can reach: the
+// inner side of four planes through the origin, each spanned by two
+// adjacent corner rays of the bundle.
+class Frustum {
+public:
+	// corners are the directions of the bundle's four outermost rays,
+	// in order around it; every other ray must be a positive
+	// combination of them.
+	void set(const glm::dvec3& origin, const glm::dvec3 corners[4]);
+
+	// False only if no ray of the bundle can reach the box.
+	bool mayHit(const glm::dvec3& bmin, const glm::dvec3& bmax) const;
+
+	const glm::dvec3& getOrigin() const { return origin; }
+	// A direction inside the bundle, for ordering traversal.
+	const glm::dvec3& getCenter() const { return center; }
+
+private:
+	glm::dvec3 origin;
+	glm::dvec3 center;
+	glm::dvec3 normals[4]; // unit, pointing inwards; zero if degenerate
+};
+
+// Up to MAX_RAYS rays from a common origin, such as the camera rays
+// through a block of pixels, that are intersected with the scene
+// together.  An acceleration structure tests each node against the
+// packet's frustum before it tests it against single rays, so a node
+// that none of the rays can reach is rejected in a few dot products,
+// and each node is fetched once for the whole packet.
+//
+// Each ray keeps the closest hit found so far, and traversal uses it to
+// cut off whatever lies beyond, just as it does for a single ray.
+class RayPacket {
+public:
+	static constexpr int MAX_RAYS = 64;
+
+	RayPacket();
+
+	void clear();
+	// r must start where the rays already added do.
+	void add(const ray& r);
+	// Set the frustum from the rays at the four indices in corners,
+	// which must enclose all the others.
+	void bound(const int corners[4]);
+
+	int size() const { return (int)rays.size(); }
+	ray& getRay(int k) { return rays[k]; }
+	const glm::dvec3& getInverseDirection(int k) const
+	{
+		return invDirs[k];
+	}
+	const Frustum& getFrustum() const { return frustum; }
+
+	bool hasHit(int k) const { return (hitMask >> k) & 1; }
+	// Ray k's closest hit; only meaningful if hasHit(k).
+	isect& getIsect(int k) { return hits[k]; }
+	// Mark getIsect(k) as holding a hit.
+	void setHit(int k) { hitMask |= uint64_t(1) << k; }
+	// Make i ray k's hit if it is closer than the one it has.
+	void offer(int k, const isect& i);
+
+	// The distance to ray k's closest hit, or infinity if it has none.
+	double maxT(int k) const;
+	// The largest maxT() over all rays: nothing farther than this from
+	// the origin can change any of the results.
+	double farthestHit() const;
+
+private:
+	std::vector<ray> rays;
+	glm::dvec3 invDirs[MAX_RAYS];
+	isect hits[MAX_RAYS];
+	uint64_t hitMask;
+	Frustum frustum;
+};
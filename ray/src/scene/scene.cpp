@@ -3,21 +3,28 @@
 #include "scene.h"
 #include "light.h"
 #include "kdTree.h"
+#include "rayPacket.h"
 #include "../ui/TraceUI.h"
 #include <glm/gtx/extended_min_max.hpp>
 #include <iostream>
 #include <glm/gtx/io.hpp>
 
+extern TraceUI* traceUI;
+
 using namespace std;
 
 bool Geometry::intersect(ray& r, isect& i) const {
 	double tmin, tmax;
 	if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax))) return false;
+	// Objects already in world space (see bakeTransform()) need no
+	// transforming at all.
+	if (transform->isIdentity())
+		return intersectLocal(r, i);
 	// Transform the ray into the object's local coordinate space
 	glm::dvec3 pos = transform->globalToLocalCoords(r.getPosition());
-	glm::dvec3 dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+	glm::dvec3 dir = transform->globalToLocalDirection(r.getDirection());
 	double length = glm::length(dir);
-	dir = glm::normalize(dir);
+	dir /= length;
 	// Backup World pos/dir, and switch to local pos/dir
 	glm::dvec3 Wpos = r.getPosition();
 	glm::dvec3 Wdir = r.getDirection();
@@ -37,6 +44,78 @@ bool Geometry::intersect(ray& r, isect& i) const {
 	return rtrn;
 }
 
+void Geometry::intersectPacket(RayPacket& packet) const
+{
+	if (hasBoundingBoxCapability() &&
+	    !packet.getFrustum().mayHit(bounds.getMin(), bounds.getMax()))
+		return;
+	if (transform->isIdentity()) {
+		intersectPacketLocal(packet);
+		return;
+	}
+	// Each ray has its own length in local space, so they go one by one.
+	for (int k = 0; k < packet.size(); k++) {
+		isect cur;
+		if (intersect(packet.getRay(k), cur))
+			packet.offer(k, cur);
+	}
+}
+
+void Geometry::intersectPacketLocal(RayPacket& packet) const
+{
+	for (int k = 0; k < packet.size(); k++) {
+		ray& r = packet.getRay(k);
+		double tmin, tmax;
+		if (hasBoundingBoxCapability() &&
+		    (!bounds.intersect(r, tmin, tmax) || tmin > packet.maxT(k)))
+			continue;
+		isect cur;
+		if (intersectLocal(r, cur))
+			packet.offer(k, cur);
+	}
+}
+
+bool Geometry::occlude(ray& r, double tMax, glm::dvec3& atten) const
+{
+	double tmin, tmax;
+	if (hasBoundingBoxCapability() &&
+	    (!bounds.intersect(r, tmin, tmax) || tmin >= tMax))
+		return false;
+	if (transform->isIdentity())
+		return occludeLocal(r, tMax, atten);
+	glm::dvec3 pos = transform->globalToLocalCoords(r.getPosition());
+	glm::dvec3 dir = transform->globalToLocalDirection(r.getDirection());
+	double length = glm::length(dir);
+	glm::dvec3 Wpos = r.getPosition();
+	glm::dvec3 Wdir = r.getDirection();
+	r.setPosition(pos);
+	r.setDirection(dir / length);
+	bool blocked = occludeLocal(r, tMax * length, atten);
+	r.setPosition(Wpos);
+	r.setDirection(Wdir);
+	return blocked;
+}
+
+bool Geometry::occludeLocal(ray& r, double tMax, glm::dvec3& atten) const
+{
+	glm::dvec3 start = r.getPosition();
+	double t = 0.0;
+	bool blocked = false;
+	isect i;
+	while (intersectLocal(r, i) && t + i.getT() < tMax) {
+		Material m = i.getMaterial();
+		if (!m.Trans()) {
+			blocked = true;
+			break;
+		}
+		atten *= m.kt(i);
+		t += i.getT();
+		r.setPosition(start + t * r.getDirection());
+	}
+	r.setPosition(start);
+	return blocked;
+}
+
 bool Geometry::hasBoundingBoxCapability() const {
 	// by default, primitives do not have to specify a bounding box.
 	// If this method returns true for a primitive, then either the ComputeBoundingBox() or
@@ -97,6 +176,50 @@ Scene::~Scene()
 {
 }
 
+void Scene::bakeTransforms()
+{
+	for (const auto& obj : objects)
+		obj->bakeTransform();
+}
+
+void Scene::buildObjectAccelerators(AccelCache* cache)
+{
+	for (const auto& obj : objects)
+		obj->buildAccelerator(cache);
+}
+
+void Scene::buildKdTree(int maxDepth, int leafSize)
+{
+	std::vector<Geometry*> bounded;
+	BoundingBox treeBounds;
+	boundlessObjects.clear();
+	for (const auto& obj : objects) {
+		if (obj->hasBoundingBoxCapability()) {
+			bounded.push_back(obj.get());
+			treeBounds.merge(obj->getBoundingBox());
+		} else {
+			boundlessObjects.push_back(obj.get());
+		}
+	}
+	kdtree.reset(new KdTree<Geometry>(bounded, treeBounds, maxDepth, leafSize));
+}
+
+void Scene::buildLightBvh(double epsilon)
+{
+	std::vector<LightBvh::Sphere> spheres;
+	unboundedLights.clear();
+	for (size_t k = 0; k < lights.size(); k++) {
+		LightBvh::Sphere s;
+		if (lights[k]->getInfluence(epsilon, s.center, s.radius)) {
+			s.light = (int)k;
+			spheres.push_back(s);
+		} else {
+			unboundedLights.push_back(lights[k].get());
+		}
+	}
+	lightBvh.reset(new LightBvh(std::move(spheres)));
+}
+
 void Scene::add(Geometry* obj) {
 	obj->ComputeBoundingBox();
 	sceneBounds.merge(obj->getBoundingBox());
@@ -112,10 +235,8 @@ void Scene::add(Light* light)
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
 bool Scene::intersect(ray& r, isect& i) const {
-	double tmin = 0.0;
-	double tmax = 0.0;
 	bool have_one = false;
-	for(const auto& obj : objects) {
+	auto test = [&](const Geometry* obj) {
 		isect cur;
 		if( obj->intersect(r, cur) ) {
 			if(!have_one || (cur.getT() < i.getT())) {
@@ -123,6 +244,14 @@ bool Scene::intersect(ray& r, isect& i) const {
 				have_one = true;
 			}
 		}
+	};
+	if (kdtree && traceUI->kdSwitch()) {
+		have_one = kdtree->intersect(r, i);
+		for (auto obj : boundlessObjects)
+			test(obj);
+	} else {
+		for (const auto& obj : objects)
+			test(obj.get());
 	}
 	if(!have_one)
 		i.setT(1000.0);
@@ -132,6 +261,44 @@ bool Scene::intersect(ray& r, isect& i) const {
 	return have_one;
 }
 
+void Scene::intersectPacket(RayPacket& packet) const
+{
+	if (kdtree && traceUI->kdSwitch()) {
+		kdtree->intersectPacket(packet);
+		for (auto obj : boundlessObjects)
+			obj->intersectPacket(packet);
+	} else {
+		for (const auto& obj : objects)
+			obj->intersectPacket(packet);
+	}
+	for (int k = 0; k < packet.size(); k++)
+		if (!packet.hasHit(k))
+			packet.getIsect(k).setT(1000.0);
+}
+
+bool Scene::occluded(ray& r, double tMax, glm::dvec3& atten,
+                     const Geometry** blocker) const
+{
+	if (kdtree && traceUI->kdSwitch()) {
+		if (kdtree->occluded(r, tMax, atten, blocker))
+			return true;
+		for (auto obj : boundlessObjects)
+			if (obj->occlude(r, tMax, atten)) {
+				if (blocker)
+					*blocker = obj;
+				return true;
+			}
+		return false;
+	}
+	for (const auto& obj : objects)
+		if (obj->occlude(r, tMax, atten)) {
+			if (blocker)
+				*blocker = obj.get();
+			return true;
+		}
+	return false;
+}
+
 TextureMap* Scene::getTexture(string name) {
 	auto itr = textureCache.find(name);
 	if (itr == textureCache.end()) {
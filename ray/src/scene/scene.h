@@ -17,6 +17,7 @@
 
 #include "bbox.h"
 #include "camera.h"
+#include "lightBvh.h"
 #include "material.h"
 #include "ray.h"
 
@@ -29,7 +30,9 @@
 
 using std::unique_ptr;
 
+class AccelCache;
 class Light;
+class RayPacket;
 class Scene;
 
 template <typename Obj>
@@ -66,6 +69,12 @@ protected:
 	glm::dmat4x4 xform;
 	glm::dmat4x4 inverse;
 	glm::dmat3x3 normi;
+	// The inverse as a linear part and an offset: every ray tested
+	// against an object is taken through it, and the bottom row of the
+	// 4x4 matrix is always (0, 0, 0, 1).
+	glm::dmat3x3 inverseLinear;
+	glm::dvec3 inverseOffset;
+	bool identity;
 
 	// information about parent & children
 	TransformNode* parent;
@@ -89,27 +98,35 @@ public:
 	}
 
 	// Coordinate-Space transformation
-	glm::dvec3 globalToLocalCoords(const glm::dvec3& v)
+	glm::dvec3 globalToLocalCoords(const glm::dvec3& v) const
 	{
-		return inverse * v;
+		return inverseLinear * v + inverseOffset;
 	}
 
-	glm::dvec3 localToGlobalCoords(const glm::dvec3& v)
+	// Directions are not affected by the translation.
+	glm::dvec3 globalToLocalDirection(const glm::dvec3& v) const
+	{
+		return inverseLinear * v;
+	}
+
+	glm::dvec3 localToGlobalCoords(const glm::dvec3& v) const
 	{
 		return xform * v;
 	}
 
-	glm::dvec4 localToGlobalCoords(const glm::dvec4& v)
+	glm::dvec4 localToGlobalCoords(const glm::dvec4& v) const
 	{
 		return xform * v;
 	}
 
-	glm::dvec3 localToGlobalCoordsNormal(const glm::dvec3& v)
+	glm::dvec3 localToGlobalCoordsNormal(const glm::dvec3& v) const
 	{
 		return glm::normalize(normi * v);
 	}
 
 	const glm::dmat4x4& transform() const { return xform; }
+	const glm::dmat3x3& normalTransform() const { return normi; }
+	bool isIdentity() const { return identity; }
 
 protected:
 	// protected so that users can't directly construct one of these...
@@ -125,6 +142,9 @@ protected:
 			this->xform = parent->xform * xform;
 		inverse = glm::inverse(this->xform);
 		normi = glm::transpose(glm::inverse(glm::dmat3x3(this->xform)));
+		inverseLinear = glm::dmat3x3(inverse);
+		inverseOffset = glm::dvec3(inverse[3]);
+		identity = this->xform == glm::dmat4x4(1.0);
 	}
 };
 
@@ -142,10 +162,30 @@ protected:
 	// do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal(ray& r, isect& i) const = 0;
 
+	// Offer the packet each of its rays' hits in local space, which is
+	// also world space: only called under an identity transform.  The
+	// default tests one ray at a time.
+	virtual void intersectPacketLocal(RayPacket& packet) const;
+
+	// occlude() in local space.  The default steps from one hit to the
+	// next with intersectLocal().
+	virtual bool occludeLocal(ray& r, double tMax,
+	                          glm::dvec3& atten) const;
+
 public:
 	// intersections performed in the global coordinate space.
 	bool intersect(ray& r, isect& i) const;
 
+	// Offer each ray of packet this object's hit, if it has one, as
+	// intersect() would find it.
+	void intersectPacket(RayPacket& packet) const;
+
+	// Whether an opaque surface of this object lies along r closer than
+	// tMax.  If not, atten is multiplied by the kt of every transmissive
+	// surface crossed on the way.  Only the materials of the surfaces
+	// crossed are looked at; no normal is computed.
+	bool occlude(ray& r, double tMax, glm::dvec3& atten) const;
+
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
 	glm::dvec3 getNormal() { return glm::dvec3(1.0, 0.0, 0.0); }
@@ -157,6 +197,17 @@ public:
 	// this should be overridden if hasBoundingBoxCapability() is true.
 	virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
+	// Build any acceleration structure private to this object, or take
+	// it from cache (which may be null).  Called once for every object,
+	// after the whole scene has been parsed.
+	virtual void buildAccelerator(AccelCache* cache) {}
+
+	// Move the object's geometry into world space, if it can, and put it
+	// under the identity transform so that rays need not be transformed
+	// into its local space.  Called once for every object, after the
+	// whole scene has been parsed and before buildAccelerator().
+	virtual void bakeTransform() {}
+
 	void setTransform(TransformNode* transform)
 	{
 		this->transform = transform;
@@ -190,6 +241,13 @@ public:
 	virtual const Material& getMaterial() const = 0;
 	virtual void setMaterial(Material* m) = 0;
 
+	// The material at hit i on this object.  Objects whose material
+	// varies over their surface override this.
+	virtual Material getMaterialAt(const isect& i) const
+	{
+		return getMaterial();
+	}
+
 	void glDraw(int quality, bool actualMaterials,
 	            bool actualTextures) const;
 
@@ -232,6 +290,52 @@ public:
 
 	bool intersect(ray& r, isect& i) const;
 
+	// The closest hit of every ray of packet, as intersect() finds for
+	// each alone.  For coherent rays, such as those from the camera.
+	void intersectPacket(RayPacket& packet) const;
+
+	// Any-hit query for shadow rays: whether something opaque lies
+	// along r closer than tMax.  If not, atten is multiplied by the kt of
+	// every transmissive surface in between.  Stops at the first opaque
+	// surface it finds, whichever that is, and stores it in blocker if
+	// that is not null.
+	bool occluded(ray& r, double tMax, glm::dvec3& atten,
+	              const Geometry** blocker = nullptr) const;
+
+	// Let every object that can move itself into world space do so.
+	// Call once, after all objects have been added.
+	void bakeTransforms();
+
+	// Build every object's own acceleration structure, reusing those in
+	// cache if it is not null.  Call once, after all objects have been
+	// added.
+	void buildObjectAccelerators(AccelCache* cache);
+
+	// Build the kd-tree over every object with a bounding box.  Call once,
+	// after all objects have been added.
+	void buildKdTree(int maxDepth, int leafSize);
+
+	// Sort the lights by where they can matter: a light fading with
+	// distance is only shaded with where its contribution is at least
+	// epsilon.  Call once, after all lights have been added.
+	void buildLightBvh(double epsilon);
+
+	// Call f(light) for every light that may matter at p: those that do
+	// not fade with distance, then those within their sphere of
+	// influence.  Every light if buildLightBvh() has not been called.
+	template <typename F>
+	void forEachLightAt(const glm::dvec3& p, F f) const
+	{
+		if (!lightBvh) {
+			for (const auto& light : lights)
+				f(light.get());
+			return;
+		}
+		for (auto light : unboundedLights)
+			f(light);
+		lightBvh->visit(p, [&](int k) { f(lights[k].get()); });
+	}
+
 	auto beginLights() const { return lights.begin(); }
 	auto endLights() const { return lights.end(); }
 	const auto& getAllLights() const { return lights; }
@@ -283,7 +387,15 @@ private:
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
 
-	KdTree<Geometry>* kdtree;
+	std::unique_ptr<KdTree<Geometry>> kdtree;
+
+	// Objects without hasBoundingBoxCapability() cannot be placed in the
+	// kd-tree and are tested against every ray instead.
+	std::vector<Geometry*> boundlessObjects;
+
+	// Lights with a sphere of influence, and the rest.
+	std::unique_ptr<LightBvh> lightBvh;
+	std::vector<Light*> unboundedLights;
 
 public:
 	// This is used for debugging purposes only.
@@ -0,0 +1,313 @@
+#include "trianglePack.h"
+
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+// The SIMD kernels are each compiled for their own instruction set and
+// only ever called after checking the CPU for it, so the rest of the
+// program still runs on machines without them.
+#if (defined(__GNUC__) || defined(__clang__)) && \
+        (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PACK_X86 1
+#endif
+
+namespace {
+const int WIDTH = TrianglePack::WIDTH;
+
+// Every quantity in the test is a short sum of products, so its rounding
+// error is bounded by a few float epsilons times the same sum taken over
+// absolute values.  This is that factor, with plenty to spare.
+const float ERROR_SCALE = 4.0e-6f;
+
+typedef int (*PackKernel)(const TrianglePack& pack, const float o[3],
+                          const float d[3], float minT, float maxT);
+
+// The tests, written out once here for one lane.  With P = d x e2,
+// T = o - v0 and Q = T x e1, the ray hits where det = e1.P is nonzero and
+// u = T.P / det, v = d.Q / det and t = e2.Q / det are in range.  Instead
+// of dividing, the numerators are compared against the range scaled by
+// |det|, each widened by its error bound; a det within its own error of
+// zero has an unreliable sign, so such lanes always pass.
+int candidatesScalar(const TrianglePack& pack, const float o[3],
+                     const float d[3], float minT, float maxT)
+{
+	int mask = 0;
+	for (int k = 0; k < WIDTH; k++) {
+		float e1[3], e2[3], t[3], ae1[3], ae2[3], at[3], ad[3];
+		for (int a = 0; a < 3; a++) {
+			e1[a] = pack.e1[a][k];
+			e2[a] = pack.e2[a][k];
+			t[a] = o[a] - pack.v0[a][k];
+			ae1[a] = std::abs(e1[a]);
+			ae2[a] = std::abs(e2[a]);
+			at[a] = std::abs(o[a]) + std::abs(pack.v0[a][k]);
+			ad[a] = std::abs(d[a]);
+		}
+		float p[3], q[3], bp[3], bq[3];
+		for (int a = 0; a < 3; a++) {
+			int b = (a + 1) % 3, c = (a + 2) % 3;
+			p[a] = d[b] * e2[c] - d[c] * e2[b];
+			q[a] = t[b] * e1[c] - t[c] * e1[b];
+			bp[a] = ad[b] * ae2[c] + ad[c] * ae2[b];
+			bq[a] = at[b] * ae1[c] + at[c] * ae1[b];
+		}
+		float det = 0, u = 0, v = 0, tt = 0;
+		float errDet = 0, errU = 0, errV = 0, errT = 0;
+		for (int a = 0; a < 3; a++) {
+			det += e1[a] * p[a];
+			u += t[a] * p[a];
+			v += d[a] * q[a];
+			tt += e2[a] * q[a];
+			errDet += ae1[a] * bp[a];
+			errU += at[a] * bp[a];
+			errV += ad[a] * bq[a];
+			errT += ae2[a] * bq[a];
+		}
+		errDet *= ERROR_SCALE;
+		errU *= ERROR_SCALE;
+		errV *= ERROR_SCALE;
+		errT *= ERROR_SCALE;
+
+		if (det < 0) {
+			det = -det;
+			u = -u;
+			v = -v;
+			tt = -tt;
+		}
+		bool hit = det <= errDet ||
+		           (u >= -errU && v >= -errV &&
+		            u + v <= det + errDet + errU + errV &&
+		            tt >= minT * det - minT * errDet - errT &&
+		            tt <= maxT * (det + errDet) + errT);
+		if (hit)
+			mask |= 1 << k;
+	}
+	return mask;
+}
+
+#ifdef PACK_X86
+__attribute__((target("sse2"))) inline __m128 absSse(__m128 x)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+}
+
+// candidatesScalar(), four lanes at a time.
+__attribute__((target("sse2"))) int candidatesSse(const TrianglePack& pack,
+                                                  const float o[3],
+                                                  const float d[3],
+                                                  float minT, float maxT)
+{
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 scale = _mm_set1_ps(ERROR_SCALE);
+	__m128 dv[3], ad[3], ov[3], ao[3];
+	for (int a = 0; a < 3; a++) {
+		dv[a] = _mm_set1_ps(d[a]);
+		ad[a] = absSse(dv[a]);
+		ov[a] = _mm_set1_ps(o[a]);
+		ao[a] = absSse(ov[a]);
+	}
+	__m128 vMinT = _mm_set1_ps(minT), vMaxT = _mm_set1_ps(maxT);
+
+	int mask = 0;
+	for (int h = 0; h < WIDTH; h += 4) {
+		__m128 e1[3], e2[3], t[3], ae1[3], ae2[3], at[3];
+		for (int a = 0; a < 3; a++) {
+			e1[a] = _mm_loadu_ps(pack.e1[a] + h);
+			e2[a] = _mm_loadu_ps(pack.e2[a] + h);
+			__m128 v0 = _mm_loadu_ps(pack.v0[a] + h);
+			t[a] = _mm_sub_ps(ov[a], v0);
+			ae1[a] = absSse(e1[a]);
+			ae2[a] = absSse(e2[a]);
+			at[a] = _mm_add_ps(ao[a], absSse(v0));
+		}
+		__m128 p[3], q[3], bp[3], bq[3];
+		for (int a = 0; a < 3; a++) {
+			int b = (a + 1) % 3, c = (a + 2) % 3;
+			p[a] = _mm_sub_ps(_mm_mul_ps(dv[b], e2[c]),
+			                  _mm_mul_ps(dv[c], e2[b]));
+			q[a] = _mm_sub_ps(_mm_mul_ps(t[b], e1[c]),
+			                  _mm_mul_ps(t[c], e1[b]));
+			bp[a] = _mm_add_ps(_mm_mul_ps(ad[b], ae2[c]),
+			                   _mm_mul_ps(ad[c], ae2[b]));
+			bq[a] = _mm_add_ps(_mm_mul_ps(at[b], ae1[c]),
+			                   _mm_mul_ps(at[c], ae1[b]));
+		}
+		__m128 det = _mm_setzero_ps(), u = det, v = det, tt = det;
+		__m128 errDet = det, errU = det, errV = det, errT = det;
+		for (int a = 0; a < 3; a++) {
+			det = _mm_add_ps(det, _mm_mul_ps(e1[a], p[a]));
+			u = _mm_add_ps(u, _mm_mul_ps(t[a], p[a]));
+			v = _mm_add_ps(v, _mm_mul_ps(dv[a], q[a]));
+			tt = _mm_add_ps(tt, _mm_mul_ps(e2[a], q[a]));
+			errDet = _mm_add_ps(errDet, _mm_mul_ps(ae1[a], bp[a]));
+			errU = _mm_add_ps(errU, _mm_mul_ps(at[a], bp[a]));
+			errV = _mm_add_ps(errV, _mm_mul_ps(ad[a], bq[a]));
+			errT = _mm_add_ps(errT, _mm_mul_ps(ae2[a], bq[a]));
+		}
+		errDet = _mm_mul_ps(errDet, scale);
+		errU = _mm_mul_ps(errU, scale);
+		errV = _mm_mul_ps(errV, scale);
+		errT = _mm_mul_ps(errT, scale);
+
+		__m128 s = _mm_and_ps(det, sign);
+		det = _mm_xor_ps(det, s);
+		u = _mm_xor_ps(u, s);
+		v = _mm_xor_ps(v, s);
+		tt = _mm_xor_ps(tt, s);
+
+		__m128 lo = _mm_sub_ps(_mm_mul_ps(vMinT, _mm_sub_ps(det, errDet)),
+		                       errT);
+		__m128 hi = _mm_add_ps(_mm_mul_ps(vMaxT, _mm_add_ps(det, errDet)),
+		                       errT);
+		__m128 hit = _mm_cmpge_ps(u, _mm_xor_ps(errU, sign));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(v, _mm_xor_ps(errV, sign)));
+		hit = _mm_and_ps(
+		        hit,
+		        _mm_cmple_ps(_mm_add_ps(u, v),
+		                     _mm_add_ps(_mm_add_ps(det, errDet),
+		                                _mm_add_ps(errU, errV))));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(tt, lo));
+		hit = _mm_and_ps(hit, _mm_cmple_ps(tt, hi));
+		hit = _mm_or_ps(hit, _mm_cmple_ps(det, errDet));
+		mask |= _mm_movemask_ps(hit) << h;
+	}
+	return mask;
+}
+
+__attribute__((target("avx"))) inline __m256 absAvx(__m256 x)
+{
+	return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+}
+
+// candidatesScalar(), all eight lanes at once.
+__attribute__((target("avx"))) int candidatesAvx(const TrianglePack& pack,
+                                                 const float o[3],
+                                                 const float d[3],
+                                                 float minT, float maxT)
+{
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 scale = _mm256_set1_ps(ERROR_SCALE);
+	__m256 dv[3], ad[3], t[3], at[3], e1[3], e2[3], ae1[3], ae2[3];
+	for (int a = 0; a < 3; a++) {
+		dv[a] = _mm256_set1_ps(d[a]);
+		ad[a] = absAvx(dv[a]);
+		__m256 ov = _mm256_set1_ps(o[a]);
+		__m256 v0 = _mm256_loadu_ps(pack.v0[a]);
+		t[a] = _mm256_sub_ps(ov, v0);
+		at[a] = _mm256_add_ps(absAvx(ov), absAvx(v0));
+		e1[a] = _mm256_loadu_ps(pack.e1[a]);
+		e2[a] = _mm256_loadu_ps(pack.e2[a]);
+		ae1[a] = absAvx(e1[a]);
+		ae2[a] = absAvx(e2[a]);
+	}
+	__m256 p[3], q[3], bp[3], bq[3];
+	for (int a = 0; a < 3; a++) {
+		int b = (a + 1) % 3, c = (a + 2) % 3;
+		p[a] = _mm256_sub_ps(_mm256_mul_ps(dv[b], e2[c]),
+		                     _mm256_mul_ps(dv[c], e2[b]));
+		q[a] = _mm256_sub_ps(_mm256_mul_ps(t[b], e1[c]),
+		                     _mm256_mul_ps(t[c], e1[b]));
+		bp[a] = _mm256_add_ps(_mm256_mul_ps(ad[b], ae2[c]),
+		                      _mm256_mul_ps(ad[c], ae2[b]));
+		bq[a] = _mm256_add_ps(_mm256_mul_ps(at[b], ae1[c]),
+		                      _mm256_mul_ps(at[c], ae1[b]));
+	}
+	__m256 det = _mm256_setzero_ps(), u = det, v = det, tt = det;
+	__m256 errDet = det, errU = det, errV = det, errT = det;
+	for (int a = 0; a < 3; a++) {
+		det = _mm256_add_ps(det, _mm256_mul_ps(e1[a], p[a]));
+		u = _mm256_add_ps(u, _mm256_mul_ps(t[a], p[a]));
+		v = _mm256_add_ps(v, _mm256_mul_ps(dv[a], q[a]));
+		tt = _mm256_add_ps(tt, _mm256_mul_ps(e2[a], q[a]));
+		errDet = _mm256_add_ps(errDet, _mm256_mul_ps(ae1[a], bp[a]));
+		errU = _mm256_add_ps(errU, _mm256_mul_ps(at[a], bp[a]));
+		errV = _mm256_add_ps(errV, _mm256_mul_ps(ad[a], bq[a]));
+		errT = _mm256_add_ps(errT, _mm256_mul_ps(ae2[a], bq[a]));
+	}
+	errDet = _mm256_mul_ps(errDet, scale);
+	errU = _mm256_mul_ps(errU, scale);
+	errV = _mm256_mul_ps(errV, scale);
+	errT = _mm256_mul_ps(errT, scale);
+
+	__m256 s = _mm256_and_ps(det, sign);
+	det = _mm256_xor_ps(det, s);
+	u = _mm256_xor_ps(u, s);
+	v = _mm256_xor_ps(v, s);
+	tt = _mm256_xor_ps(tt, s);
+
+	__m256 lo = _mm256_sub_ps(
+	        _mm256_mul_ps(_mm256_set1_ps(minT), _mm256_sub_ps(det, errDet)),
+	        errT);
+	__m256 hi = _mm256_add_ps(
+	        _mm256_mul_ps(_mm256_set1_ps(maxT), _mm256_add_ps(det, errDet)),
+	        errT);
+	__m256 hit = _mm256_cmp_ps(u, _mm256_xor_ps(errU, sign), _CMP_GE_OQ);
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, _mm256_xor_ps(errV, sign),
+	                                       _CMP_GE_OQ));
+	hit = _mm256_and_ps(
+	        hit, _mm256_cmp_ps(_mm256_add_ps(u, v),
+	                           _mm256_add_ps(_mm256_add_ps(det, errDet),
+	                                         _mm256_add_ps(errU, errV)),
+	                           _CMP_LE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, lo, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, hi, _CMP_LE_OQ));
+	hit = _mm256_or_ps(hit, _mm256_cmp_ps(det, errDet, _CMP_LE_OQ));
+	return _mm256_movemask_ps(hit);
+}
+#endif
+
+PackKernel chooseKernel()
+{
+#ifdef PACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		return candidatesAvx;
+	if (__builtin_cpu_supports("sse2"))
+		return candidatesSse;
+#endif
+	return candidatesScalar;
+}
+
+const PackKernel kernel = chooseKernel();
+}
+
+TrianglePack::TrianglePack(const glm::dvec3& c)
+{
+	memset(v0, 0, sizeof(v0));
+	memset(e1, 0, sizeof(e1));
+	memset(e2, 0, sizeof(e2));
+	for (int a = 0; a < 3; a++)
+		center[a] = c[a];
+	for (int k = 0; k < WIDTH; k++)
+		id[k] = -1;
+	valid = 0;
+}
+
+void TrianglePack::setLane(int lane, const glm::dvec3& a,
+                           const glm::dvec3& b, const glm::dvec3& c,
+                           int32_t triangle)
+{
+	for (int k = 0; k < 3; k++) {
+		v0[k][lane] = (float)(a[k] - center[k]);
+		e1[k][lane] = (float)(b[k] - a[k]);
+		e2[k][lane] = (float)(c[k] - a[k]);
+	}
+	id[lane] = triangle;
+	valid |= 1 << lane;
+}
+
+int TrianglePack::candidates(const glm::dvec3& p, const glm::dvec3& d,
+                             double minT, double maxT) const
+{
+	float o[3], dir[3];
+	for (int a = 0; a < 3; a++) {
+		o[a] = (float)(p[a] - center[a]);
+		dir[a] = (float)d[a];
+	}
+	return kernel(*this, o, dir, (float)minT,
+	              (float)std::min(maxT, (double)FLT_MAX)) &
+	       valid;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <glm/vec3.hpp>
+
+// Up to WIDTH triangles laid out side by side in single precision, so
+// that one ray can be tested against all of them with a single set of
+// SIMD Moller-Trumbore steps.  Each triangle is stored as a corner and
+// its two edges, relative to the pack's center so that the float values
+// keep their precision however far the mesh is from the origin.
+//
+// The float test is only a filter: it is conservative, with error bounds
+// on every comparison, so a triangle it rejects cannot be hit; the caller
+// then intersects the (usually zero or one) candidates exactly.  That
+// keeps the results identical to testing each triangle in double.
+//
+// The kernel is picked once at startup from what the CPU supports: AVX
+// tests all eight lanes at once, SSE tests them four at a time, and a
+// scalar loop is used everywhere else.
+struct TrianglePack {
+	static constexpr int WIDTH = 8;
+
+	float v0[3][WIDTH];
+	float e1[3][WIDTH];
+	float e2[3][WIDTH];
+	double center[3];
+	int32_t id[WIDTH]; // triangle in each lane, -1 if unused
+	int valid;         // bit k is set if lane k holds a triangle
+
+	// An empty pack around center; unused lanes can never be hit.
+	explicit TrianglePack(const glm::dvec3& center);
+
+	void setLane(int lane, const glm::dvec3& a, const glm::dvec3& b,
+	             const glm::dvec3& c, int32_t triangle);
+
+	// Lanes (bit k for lane k) whose triangle ray p + t d may hit with
+	// minT < t < maxT.  d need not be normalized.
+	int candidates(const glm::dvec3& p, const glm::dvec3& d, double minT,
+	               double maxT) const;
+};
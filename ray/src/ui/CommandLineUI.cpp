@@ -1,6 +1,8 @@
 #include <stdarg.h>
 #include <time.h>
+#include <chrono>
 #include <iostream>
+#include <thread>
 #ifndef __WIN32
 #include <unistd.h>
 #else
@@ -26,8 +28,11 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 	progName = argv[0];
 	const char* jsonfile = nullptr;
 	string cubemap_file;
-	while ((i = getopt(argc, argv, "tr:w:hj:c:")) != EOF) {
+	while ((i = getopt(argc, argv, "t:r:w:hj:c:")) != EOF) {
 		switch (i) {
+			case 't':
+				m_timeBudget = atof(optarg);
+				break;
 			case 'r':
 				m_nDepth = atoi(optarg);
 				break;
@@ -70,6 +75,9 @@ CommandLineUI::CommandLineUI(int argc, char** argv) : TraceUI()
 int CommandLineUI::run()
 {
 	assert(raytracer != 0);
+	// A time budget covers everything up to writing the image, loading
+	// and building included.
+	auto budgetStart = std::chrono::steady_clock::now();
 	raytracer->loadScene(rayName);
 
 	if (raytracer->sceneLoaded()) {
@@ -77,31 +85,101 @@ int CommandLineUI::run()
 		int height = (int)(width / raytracer->aspectRatio() + 0.5);
 
 		raytracer->traceSetup(width, height);
-
-		clock_t start, end;
-		start = clock();
+		raytracer->setClampSamples(!isFloatImage(imgName));
+
+		// Wall-clock time: clock() would add up the CPU time of every
+		// render thread.
+		auto start = std::chrono::steady_clock::now();
+		resetCount();
+		uint64_t probes, hits;
+		resetOccluderCount(probes, hits);
+
+		// With a time budget, whatever the image looks like when it runs
+		// out is what gets written.
+		bool stopped = false;
+		auto finish = [&]() {
+			if (getTimeBudget() > 0.0) {
+				auto deadline = budgetStart +
+				                std::chrono::duration<double>(
+				                        getTimeBudget());
+				while (!raytracer->checkRender()) {
+					if (std::chrono::steady_clock::now() >= deadline) {
+						raytracer->stopTrace = true;
+						stopped = true;
+						break;
+					}
+					std::this_thread::sleep_for(
+					        std::chrono::milliseconds(1));
+				}
+			}
+			raytracer->waitRender();
+		};
 
 		raytracer->traceImage(width, height);
-		raytracer->waitRender();
-		if (aaSwitch()) {
+		finish();
+		// Time left over from a budget is spent supersampling, whether
+		// or not antialiasing was asked for, in finer rounds for as long
+		// as it lasts.
+		bool antiAlias = aaSwitch() || getTimeBudget() > 0.0;
+		int aaPixels = 0, aaRounds = 0;
+		if (antiAlias && !stopped) {
 			raytracer->aaImage();
-			raytracer->waitRender();
+			finish();
+			aaRounds = 1;
+			while (getTimeBudget() > 0.0 && !stopped &&
+			       raytracer->aaImage(aaRounds) > 0) {
+				finish();
+				aaRounds++;
+			}
+			aaPixels = raytracer->aaPixelCount();
 		}
 
-		end = clock();
-
-		// save image
-		unsigned char* buf;
-
-		raytracer->getBuffer(buf, width, height);
-
-		if (buf)
-			writeImage(imgName, width, height, buf);
+		auto end = std::chrono::steady_clock::now();
+
+		// save image; float formats read the float buffer directly,
+		// without making the 8-bit copy.
+		if (isFloatImage(imgName)) {
+			writeFloatImage(imgName, width, height,
+			                [this](int j, float* rgb) {
+				                raytracer->getFloatRow(j, rgb);
+			                });
+		} else {
+			unsigned char* buf;
+
+			raytracer->getBuffer(buf, width, height);
+
+			if (buf) {
+				ImageOptions options;
+				options.compression = getPngCompression();
+				options.threads = getThreads();
+				writeImage(imgName, width, height, buf, options);
+			}
+		}
 
-		double t = (double)(end - start) / CLOCKS_PER_SEC;
-		//		int totalRays = TraceUI::resetCount();
-		//		std::cout << "total time = " << t << " seconds,
-		// rays traced = " << totalRays << std::endl;
+		double t = std::chrono::duration<double>(end - start).count();
+		uint64_t rays[RAY_TYPES];
+		resetCount(rays);
+		std::cout << "build time = " << raytracer->getBuildTime()
+		          << " seconds, trace time = " << t << " seconds"
+		          << (stopped ? " (stopped at the time budget)" : "")
+		          << std::endl;
+		static const char* const names[RAY_TYPES] = {
+		        "visibility", "reflection", "refraction", "shadow"};
+		for (int type = 0; type < RAY_TYPES; type++)
+			std::cout << names[type] << " rays = " << rays[type] << " ("
+			          << (t > 0.0 ? rays[type] / t : 0.0) << " rays/sec)"
+			          << std::endl;
+		if (antiAlias)
+			std::cout << "anti-aliased pixels = " << aaPixels << " of "
+			          << width * height << " in " << aaRounds
+			          << (aaRounds == 1 ? " round" : " rounds")
+			          << (stopped && aaPixels > 0 ? " (not all finished)" : "")
+			          << std::endl;
+		resetOccluderCount(probes, hits);
+		std::cout << "shadow occluder cache hits = " << hits << " of "
+		          << probes << " ("
+		          << (probes > 0 ? 100.0 * hits / probes : 0.0) << "%)"
+		          << std::endl;
 		return 0;
 	} else {
 		std::cerr << "Unable to load ray file '" << rayName << "'"
@@ -122,6 +200,8 @@ void CommandLineUI::usage()
 	     << " [options] [input.ray output.png]" << endl
 	     << "  -r <#>      set recursion level (default " << m_nDepth << ")" << endl
 	     << "  -w <#>      set output image width (default " << m_nSize << ")" << endl
+	     << "  -t <#>      stop rendering this many seconds after starting to load" << endl
+	     << "              the scene, spending any left on antialiasing" << endl
 	     << "  -j <FILE>   set parameters from JSON file" << endl
 	     << "  -c <FILE>   one Cubemap file, the remainings will be detected automatically" << endl;
 }
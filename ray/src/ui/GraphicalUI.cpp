@@ -295,7 +295,7 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 			t_elapsed = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
 			if ((now - prev)/CLOCKS_PER_SEC * 1000 >= intervalMS)
 			{
-				print(buffer, "Time: %.2f sec, Rays: %u", t_elapsed, TraceUI::getCount());
+				print(buffer, "Time: %.2f sec, Rays: %llu", t_elapsed, (unsigned long long)TraceUI::getCount());
 				pUI->m_traceGlWindow->label(buffer);
 				pUI->m_traceGlWindow->refresh();
 				prev = now;
@@ -307,8 +307,8 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 		traceTime = clock() - startTime;
 		t_now = std::chrono::high_resolution_clock::now();
 		auto t_trace = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
-		int imageRays = TraceUI::resetCount();
-		print(buffer, "Time: %.2f sec, Rays: %u, Aa: none", t_trace, imageRays);
+		unsigned long long imageRays = TraceUI::resetCount();
+		print(buffer, "Time: %.2f sec, Rays: %llu, Aa: none", t_trace, imageRays);
 		pUI->m_traceGlWindow->label(buffer);
 		pUI->m_traceGlWindow->refresh();
 		if (pUI->aaSwitch() && !stopTrace)
@@ -329,8 +329,8 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 				t_total = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
 				if ((now - prev)/CLOCKS_PER_SEC * 1000 >= intervalMS)
 				{
-					print(buffer, "Trace: %.2f, Aa: %.2f, Total: %.2f, aaRays: %d",
-					      t_trace, t_elapsed, t_total, TraceUI::getCount()); 
+					print(buffer, "Trace: %.2f, Aa: %.2f, Total: %.2f, aaRays: %llu",
+					      t_trace, t_elapsed, t_total, (unsigned long long)TraceUI::getCount()); 
 					pUI->m_traceGlWindow->label(buffer);
 					pUI->m_traceGlWindow->refresh();
 					prev = now;
@@ -343,9 +343,9 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 			t_now = std::chrono::high_resolution_clock::now();
 			t_elapsed = std::chrono::duration<double, std::ratio<1>>(t_now - t_aaStart).count();
 			t_total = std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
-			int aaRays = TraceUI::resetCount();
-			print(buffer, "Trace: %.2f, Aa: %.2f, Total: %.2f, Rays: %u, %u, %u",
-			      t_trace, t_elapsed, t_total, imageRays, aaRays, imageRays + aaRays);
+			unsigned long long aaRays = TraceUI::resetCount();
+			print(buffer, "Trace: %.2f, Aa: %.2f (%d pixels), Total: %.2f, Rays: %llu, %llu, %llu",
+			      t_trace, t_elapsed, aaPixels, t_total, imageRays, aaRays, imageRays + aaRays);
 			pUI->m_traceGlWindow->label(buffer);
 			pUI->m_traceGlWindow->refresh();
 		}
@@ -26,8 +26,7 @@ void load(Json& j, const string& field, T& target)
 
 TraceUI::TraceUI()
 {
-	for (unsigned int i = 0; i < MAX_THREADS; i++)
-		rayCount[i] = 0;
+	resetCount();
 }
 
 TraceUI::~TraceUI()
@@ -57,6 +56,17 @@ void TraceUI::loadFromJson(const char* file)
 	load(json, "filter_width", m_nFilterWidth);
 	load(json, "anti_alias", m_antiAlias);
 	load(json, "kdtree", m_kdTree);
+	load(json, "wide_bvh", m_wideBvh);
+	load(json, "triangle_packs", m_trianglePacks);
+	load(json, "ray_packets", m_rayPackets);
+	load(json, "wavefront", m_wavefront);
+	load(json, "progressive", m_progressive);
+	load(json, "time_budget", m_timeBudget);
+	load(json, "png_compression", m_nPngCompression);
+	load(json, "accel_cache", m_accelCache);
+	load(json, "sbvh", m_sbvh);
+	load(json, "sbvh_budget", m_nSbvhBudget);
+	load(json, "light_cutoff", m_nLightCutoff);
 	load(json, "shadows", m_shadows);
 	load(json, "smoothshade", m_smoothshade);
 	load(json, "backface_culling", m_backface);
@@ -7,9 +7,15 @@
 #ifndef __TraceUI_h__
 #define __TraceUI_h__
 
+#include <stdint.h>
+#include <atomic>
 #include <string>
 #include <memory>
 #define MAX_THREADS 32
+// The per-thread slot (ray_thread_id) of every thread that is not a
+// render worker, such as the UI's; it is shared, so the workers stop
+// one short of it.
+#define OTHER_THREADS (MAX_THREADS - 1)
 
 using std::string;
 
@@ -43,6 +49,17 @@ public:
 	int getThreads() const { return m_threads; }
 	bool aaSwitch() const { return m_antiAlias; }
 	bool kdSwitch() const { return m_kdTree; }
+	bool wideBvhSwitch() const { return m_wideBvh; }
+	bool trianglePackSwitch() const { return m_trianglePacks; }
+	bool rayPacketSwitch() const { return m_rayPackets; }
+	bool wavefrontSwitch() const { return m_wavefront; }
+	bool progressiveSwitch() const { return m_progressive; }
+	double getTimeBudget() const { return m_timeBudget; }
+	int getPngCompression() const { return m_nPngCompression; }
+	bool accelCacheSwitch() const { return m_accelCache; }
+	bool sbvhSwitch() const { return m_sbvh; }
+	double getSbvhBudget() const { return (double)m_nSbvhBudget * 0.01; }
+	double getLightCutoff() const { return (double)m_nLightCutoff * 0.001; }
 	bool shadowSw() const { return m_shadows; }
 	bool smShadSw() const { return m_smoothshade; }
 	bool bkFaceSw() const { return m_backface; }
@@ -50,43 +67,87 @@ public:
 	CubeMap* getCubeMap() const { return cubemap.get(); }
 	void setCubeMap(CubeMap* cm);
 
-	// ray counter
-	static void addRays(int number, int ctr)
+	// ray counter, by thread and ray::RayType
+	static const int RAY_TYPES = 4;
+
+	static void addRays(int number, int ctr, int type)
 	{
-		if (ctr >= 0)
-			rayCount[ctr] += number;
+		if (ctr >= 0 && ctr < MAX_THREADS) {
+			// Only worker ctr writes its counters, so a plain load
+			// and store will do; no locked read-modify-write.  The
+			// slot of the other threads is shared and needs one.
+			std::atomic<uint64_t>& c = rayCount[ctr].count[type];
+			if (ctr == OTHER_THREADS)
+				c.fetch_add(number, std::memory_order_relaxed);
+			else
+				c.store(c.load(std::memory_order_relaxed) + number,
+				        std::memory_order_relaxed);
+		}
 	}
-	static void addRay(int ctr)
+	static void addRay(int ctr, int type) { addRays(1, ctr, type); }
+	static uint64_t getCount(int ctr)
 	{
-		if (ctr >= 0)
-			rayCount[ctr]++;
+		uint64_t total = 0;
+		for (int type = 0; type < RAY_TYPES; type++)
+			total += rayCount[ctr].count[type].load(
+			        std::memory_order_relaxed);
+		return total;
 	}
-	static int getCount(int ctr) { return ctr < 0 ? -1 : rayCount[ctr]; }
-	static int getCount()
+	static uint64_t getCount()
 	{
-		int total = 0;
-		for (int i = 0; i < m_threads; i++)
-			total += rayCount[i];
+		uint64_t total = 0;
+		for (int i = 0; i < MAX_THREADS; i++)
+			total += getCount(i);
 		return total;
 	}
-	static int resetCount(int ctr)
+	// Totals over all threads for each ray type, zeroing the counters.
+	static void resetCount(uint64_t counts[RAY_TYPES])
 	{
-		if (ctr < 0)
-			return -1;
-		int temp = rayCount[ctr];
-		rayCount[ctr] = 0;
-		return temp;
+		for (int type = 0; type < RAY_TYPES; type++)
+			counts[type] = 0;
+		for (int i = 0; i < MAX_THREADS; i++)
+			for (int type = 0; type < RAY_TYPES; type++)
+				counts[type] += rayCount[i].count[type].exchange(
+				        0, std::memory_order_relaxed);
 	}
-	static int resetCount()
+	static uint64_t resetCount()
 	{
-		int total = 0;
-		for (int i = 0; i < m_threads; i++) {
-			total += rayCount[i];
-			rayCount[i] = 0;
-		}
+		uint64_t counts[RAY_TYPES];
+		resetCount(counts);
+		uint64_t total = 0;
+		for (int type = 0; type < RAY_TYPES; type++)
+			total += counts[type];
 		return total;
 	}
 
+	// Shadow rays that a light first tried against the object that last
+	// blocked its light on thread ctr, and how many of those it blocked.
+	// Only workers have the cache, so only they call this.
+	static void addOccluderProbe(int ctr, bool hit)
+	{
+		if (ctr >= 0 && ctr < OTHER_THREADS) {
+			RayCounter& c = rayCount[ctr];
+			c.occluderProbes.store(c.occluderProbes.load(
+			        std::memory_order_relaxed) + 1,
+			        std::memory_order_relaxed);
+			if (hit)
+				c.occluderHits.store(c.occluderHits.load(
+				        std::memory_order_relaxed) + 1,
+				        std::memory_order_relaxed);
+		}
+	}
+	// Totals over all threads, zeroing the counters.
+	static void resetOccluderCount(uint64_t& probes, uint64_t& hits)
+	{
+		probes = hits = 0;
+		for (int i = 0; i < MAX_THREADS; i++) {
+			probes += rayCount[i].occluderProbes.exchange(
+			        0, std::memory_order_relaxed);
+			hits += rayCount[i].occluderHits.exchange(
+			        0, std::memory_order_relaxed);
+		}
+	}
+
 	static int m_threads; // number of threads to run
 	static bool m_debug;
 
@@ -105,8 +166,19 @@ protected:
 	int m_nTreeDepth = 15;    // maximum kdTree depth
 	int m_nLeafSize = 10;     // target number of objects per leaf
 	int m_nFilterWidth = 1;   // width of cubemap filter
-
-	static int rayCount[MAX_THREADS]; // Ray counter
+	int m_nSbvhBudget = 30;   // extra face references for SBVH, in percent
+	int m_nLightCutoff = 1;   // light too dim to shade with, in thousandths
+	double m_timeBudget = 0;  // seconds from loading to writing, 0 for none
+	int m_nPngCompression = -1; // zlib level for png output, -1 for default
+
+	// One cache line per thread, so that counting never bounces a line
+	// between cores.
+	struct alignas(64) RayCounter {
+		std::atomic<uint64_t> count[RAY_TYPES];
+		std::atomic<uint64_t> occluderProbes;
+		std::atomic<uint64_t> occluderHits;
+	};
+	static RayCounter rayCount[MAX_THREADS]; // Ray counter
 
 	// Determines whether or not to show debugging information
 	// for individual rays.  Disabled by default for efficiency
@@ -114,6 +186,13 @@ protected:
 	bool m_displayDebuggingInfo = false;
 	bool m_antiAlias = false;    // Is antialiasing on?
 	bool m_kdTree = true;        // use kd-tree?
+	bool m_wideBvh = true;       // traverse meshes with the 4-wide BVH?
+	bool m_trianglePacks = true; // test mesh faces in SIMD packs?
+	bool m_rayPackets = true;    // trace camera rays in packets?
+	bool m_wavefront = false;    // trace bounces breadth first?
+	bool m_progressive = false;  // render coarse previews first?
+	bool m_accelCache = true;    // keep built BVHs in <scene>.accel?
+	bool m_sbvh = false;         // allow spatial splits in mesh BVHs?
 	bool m_shadows = true;       // compute shadows?
 	bool m_smoothshade = true;   // turn on/off smoothshading?
 	bool m_backface = true;      // cull backfaces?
@@ -334,6 +334,11 @@ void Square::glDrawLocal(int quality, bool actualMaterials, bool actualTextures)
 
 void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const
 {
+	const Vertices& vertices = mesh->vertices;
+	const Faces& faces = mesh->faces;
+	const Normals& normals = mesh->normals;
+	const Materials& materials = mesh->materials;
+
 	// Could be doing this a lot more efficiently w/ vertex arrays, but that
 	// would involve changing the data storage method just for debugging purposes
 	// which is probably wrong.
@@ -354,9 +359,9 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 		glBegin( GL_TRIANGLES );
 		for( Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr )
 		{
-			const int vert1 = (*(*itr))[0];
-			const int vert2 = (*(*itr))[1];
-			const int vert3 = (*(*itr))[2];
+			const int vert1 = (*itr)[0];
+			const int vert2 = (*itr)[1];
+			const int vert3 = (*itr)[2];
 
 			if( normals.empty() )
 			{
@@ -375,19 +380,19 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 			if( ! normals.empty() )
 				glNormal3dv( &normals[vert1][0] );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert1], *itr );
+				setGLMaterial( *materials[vert1], this );
 			glVertex3dv( &vertices[vert1][0] );
 
 			if( ! normals.empty() )
 				glNormal3dv( &normals[vert2][0] );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert2], *itr );
+				setGLMaterial( *materials[vert2], this );
 			glVertex3dv( &vertices[vert2][0] );
 
 			if( ! normals.empty() )
 				glNormal3dv( &normals[vert3][0] );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert3], *itr );
+				setGLMaterial( *materials[vert3], this );
 			glVertex3dv( &vertices[vert3][0] );
 		}
 		glEnd();